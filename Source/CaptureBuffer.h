@@ -0,0 +1,116 @@
+/*
+  ==============================================================================
+
+    CaptureBuffer.h
+    Circular recording of the input bus that the grains can read like a file.
+
+  ==============================================================================
+*/
+
+#pragma once
+
+#include <JuceHeader.h>
+#include "ReferenceCountedBuffer.h"
+
+//==============================================================================
+/**
+    The ring is an ordinary ReferenceCountedBuffer, so grains and their kernels
+    read it exactly as they read a loaded file, wrap-around included. The input
+    at engine time t goes to ring index t % length. So the write head is just
+    the engine clock, and a grain that starts at onset and reads `delay`
+    samples behind the head starts at (onset - delay) % length.
+
+    Only the audio thread writes, and it writes each block before any grain is
+    rendered from it. The scheduler never touches the ring itself, only the
+    length, channel count and write head, which are all atomics. Nobody waits.
+*/
+class CaptureBuffer
+{
+public:
+    // (re)allocates the ring, call from prepareToPlay, never while the audio thread is running
+    void prepare(int numChannels, double sampleRate, double seconds, int maxBlockSize, bool doublePrecision)
+    {
+        const int newLength = juce::jmax(maxBlockSize * 4, (int) (sampleRate * seconds));
+        numChannels = juce::jmax(1, numChannels);
+        if (ring == nullptr || ring->getNumChannels() != numChannels || ring->getNumSamples() != newLength)
+            ring = new ReferenceCountedBuffer("capture", numChannels, newLength);
+        if (doublePrecision) ring->prepareDoublePrecision();
+        //reads stay this far from both the newest and the oldest sample of the ring
+        margin = maxBlockSize + 2;
+        length = newLength;
+        channels = numChannels;
+    }
+
+    // the ring itself, audio thread only
+    ReferenceCountedBuffer::Ptr getRing() const {return ring;}
+    int getLength() const {return length.load();}
+    int getNumChannels() const {return channels.load();}
+    long long int getWriteHead() const {return writeHead.load(std::memory_order_acquire);}
+
+    // records one block of input taken at engine time blockStart, audio thread only
+    template <typename SampleType>
+    void write(const juce::AudioBuffer<SampleType>& input, int numInputChannels, long long int blockStart)
+    {
+        juce::AudioBuffer<SampleType>* dest = ring != nullptr ? ring->getWriteBuffer<SampleType>() : nullptr;
+        if (dest == nullptr) return;
+        const int ringLength = dest->getNumSamples();
+        const int numSamples = juce::jmin(input.getNumSamples(), ringLength);
+        const int start = (int) (blockStart % ringLength);
+        const int first = juce::jmin(numSamples, ringLength - start);
+        for (int c = 0; c < dest->getNumChannels(); c++){
+            if (numInputChannels == 0){
+                dest->clear(c, start, first);
+                if (numSamples > first) dest->clear(c, 0, numSamples - first);
+                continue;
+            }
+            const SampleType* src = input.getReadPointer(c % numInputChannels);
+            juce::FloatVectorOperations::copy(dest->getWritePointer(c, start), src, first);
+            if (numSamples > first) juce::FloatVectorOperations::copy(dest->getWritePointer(c), src + first, numSamples - first);
+        }
+        writeHead.store(blockStart + numSamples, std::memory_order_release);
+    }
+
+    // adds the block just recorded at blockStart into dest, this is the dry signal in input mode
+    template <typename SampleType>
+    void addRecentTo(juce::AudioBuffer<SampleType>& dest, long long int blockStart, SampleType gain) const
+    {
+        const juce::AudioBuffer<SampleType>* src = ring != nullptr ? ring->getBuffer<SampleType>() : nullptr;
+        if (src == nullptr) return;
+        const int ringLength = src->getNumSamples();
+        const int numSamples = juce::jmin(dest.getNumSamples(), ringLength);
+        const int start = (int) (blockStart % ringLength);
+        const int first = juce::jmin(numSamples, ringLength - start);
+        for (int c = 0; c < dest.getNumChannels(); c++){
+            const int srcChannel = c % src->getNumChannels();
+            juce::FloatVectorOperations::addWithMultiply(dest.getWritePointer(c), src->getReadPointer(srcChannel, start), gain, first);
+            if (numSamples > first)
+                juce::FloatVectorOperations::addWithMultiply(dest.getWritePointer(c, first), src->getReadPointer(srcChannel), gain, numSamples - first);
+        }
+    }
+
+    /** Ring index where a grain starting at onset should begin reading.
+        position 1 is just behind the write head and 0 is the oldest audio that
+        is still safe. The range shrinks by however far the grain's read head
+        drifts against the write head over its length. That way a fast grain
+        never overtakes the recording, and a slow or reversed one never reads
+        audio that has already been overwritten.
+    */
+    int startPosition(long long int onset, float position, int grainLength, float rate, bool reverse) const
+    {
+        const int ringLength = getLength();
+        const int safeMargin = margin.load();
+        if (ringLength == 0) return 0;
+        const double drift = ((reverse ? -rate : rate) - 1.0) * grainLength;
+        const double minDelay = safeMargin + juce::jmax(0.0, drift);
+        const double maxDelay = juce::jmax(minDelay, ringLength - safeMargin + juce::jmin(0.0, drift));
+        const double delay = minDelay + (1.0 - juce::jlimit(0.0f, 1.0f, position)) * (maxDelay - minDelay);
+        long long int start = (onset - (long long int) std::ceil(delay)) % ringLength;
+        if (start < 0) start += ringLength;
+        return (int) start;
+    }
+
+private:
+    ReferenceCountedBuffer::Ptr ring;
+    std::atomic<long long int> writeHead {0};
+    std::atomic<int> length {0}, channels {0}, margin {0};
+};
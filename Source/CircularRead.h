@@ -0,0 +1,321 @@
+/*
+  ==============================================================================
+
+    CircularRead.h
+    Interpolated reads from a file that loops around its end.
+
+  ==============================================================================
+*/
+
+#pragma once
+
+#include <JuceHeader.h>
+
+//==============================================================================
+/**
+    Both the dry voice and the grains read the file as a loop. Instead of a
+    modulo on every read, the reads of a block are split into runs that stay
+    inside the file, and the one read that straddles the end is done on its own.
+
+    The file is read through one of the readers in ReferenceCountedBuffer.h, so
+    the same loops serve planar floats and the compact interleaved formats.
+
+    Reads between samples use one of the Interpolation tiers. Each tier reads
+    a fixed number of neighbours, so the cost of a read is bounded whatever
+    the rate. A run then has to keep the whole footprint of a read inside the
+    file.
+
+    A transposed run reads a register's worth of positions at a time: the
+    neighbours of each read are gathered into one register per tap, and the
+    interpolation runs on whole registers (juce::dsp::SIMDRegister, so SSE or
+    NEON). Only the gather itself is scalar, as SSE2 and NEON have no gather.
+*/
+namespace CircularRead
+{
+    // positions are 32.32 fixed point: the sample index in the high word, the fraction in the low word
+    using Phase = juce::int64;
+    static constexpr Phase unityIncrement = (Phase) 1 << 32;
+
+    inline Phase toPhase(double samples) {return (Phase) std::llround(samples * 4294967296.0);}
+    inline double toSamples(Phase p) {return (double) p * (1.0 / 4294967296.0);}
+    inline int index(Phase p) {return (int) (p >> 32);}
+    // floats take the top 24 bits of the fraction so it stays exact and below 1, doubles take all 32
+    template <typename SampleType = float>
+    inline SampleType fraction(Phase p){
+        if constexpr (std::is_same_v<SampleType, double>) return (double) (juce::uint32) p * (1.0 / 4294967296.0);
+        else return (float) ((juce::uint32) p >> 8) * (1.0f / 16777216.0f);
+    }
+
+    template <typename SampleType>
+    inline SampleType linearInterp(SampleType x, SampleType y0, SampleType y1) {return y0 + x * (y1 - y0);}
+
+    template <typename SampleType>
+    using Vec = juce::dsp::SIMDRegister<SampleType>;
+    template <typename SampleType>
+    constexpr int numLanes = (int) Vec<SampleType>::SIMDNumElements;
+
+    /** Reads numLanes positions at a time from p on, `increment` apart. Tap k
+        of every lane, sample i0 - Before + k, is gathered into taps[k], and
+        combine(taps, fractions) returns the lanes' results. They are stored
+        into out, or added to it when Add is set. p is left on the first read
+        not done, and the number of reads done (a whole number of registers)
+        is returned, the rest is left to a scalar loop.
+    */
+    template <int Before, int Taps, bool Add, typename SampleType, typename Reader, typename Combine>
+    inline int gatherRun(SampleType* out, const Reader& fileData, Phase& p, Phase increment, int numSamples, Combine&& combine)
+    {
+        constexpr int lanes = numLanes<SampleType>;
+        alignas (Vec<SampleType>::SIMDRegisterSize) SampleType gathered[Taps][lanes];
+        alignas (Vec<SampleType>::SIMDRegisterSize) SampleType fractions[lanes];
+        alignas (Vec<SampleType>::SIMDRegisterSize) SampleType results[lanes];
+        Vec<SampleType> taps[Taps];
+        int i = 0;
+        for (; i + lanes <= numSamples; i += lanes){
+            for (int l = 0; l < lanes; l++){
+                const int first = index(p) - Before;
+                for (int k = 0; k < Taps; k++) gathered[k][l] = (SampleType) fileData[first + k];
+                fractions[l] = fraction<SampleType>(p);
+                p += increment;
+            }
+            for (int k = 0; k < Taps; k++) taps[k] = Vec<SampleType>::fromRawArray(gathered[k]);
+            combine(taps, Vec<SampleType>::fromRawArray(fractions)).copyToRawArray(results);
+            for (int l = 0; l < lanes; l++){
+                if constexpr (Add) out[i + l] += results[l];
+                else out[i + l] = results[l];
+            }
+        }
+        return i;
+    }
+
+    //==============================================================================
+    enum class Interpolation {linear, hermite, sinc8, sinc16};
+    inline juce::StringArray getInterpolationNames() {return {"linear", "hermite", "sinc 8", "sinc 16"};}
+
+    /** Blackman-windowed sinc coefficients for Taps neighbours, worked out once
+        for numPhases fractions plus the fraction 1. Each row sums to 1, and the
+        rows at 0 and 1 pick a single sample, so whole-sample reads stay exact.
+        There is a table per sample type, its rows aligned for SIMDRegister loads.
+    */
+    template <int Taps, typename SampleType = float>
+    struct SincTable
+    {
+        static constexpr int numPhases = 256;
+        static_assert (Taps % numLanes<SampleType> == 0);
+
+        static const SincTable& get() {static const SincTable table; return table;}
+        const SampleType* row(int phase) const {return coefficients + phase * Taps;}
+
+    private:
+        SincTable(){
+            const double pi = juce::MathConstants<double>::pi;
+            for (int p = 0; p <= numPhases; p++){
+                const double frac = (double) p / numPhases;
+                SampleType* c = coefficients + p * Taps;
+                double sum = 0;
+                for (int k = 0; k < Taps; k++){
+                    //tap k reads sample i0 - (Taps / 2 - 1) + k
+                    const double x = (double) (k - Taps / 2 + 1) - frac;
+                    const double sinc = x == 0 ? 1.0 : std::sin(pi * x) / (pi * x);
+                    const double w = (x + Taps / 2) / Taps;
+                    const double window = 0.42 - 0.5 * std::cos(2 * pi * w) + 0.08 * std::cos(4 * pi * w);
+                    c[k] = (SampleType) (sinc * window);
+                    sum += c[k];
+                }
+                for (int k = 0; k < Taps; k++) c[k] = (SampleType) (c[k] / sum);
+            }
+        }
+
+        alignas (Vec<SampleType>::SIMDRegisterSize) SampleType coefficients[(numPhases + 1) * Taps];
+    };
+
+    /** One interpolated read at i0 + frac. `at(i)` returns sample i, and a
+        read touches samples i0 - before to i0 + after.
+    */
+    template <Interpolation Tier>
+    struct Interpolator
+    {
+        static constexpr int before = 0, after = 1;
+
+        template <typename SampleType, typename Get>
+        static SampleType read(const Get& at, int i0, SampleType frac) {return linearInterp(frac, at(i0), at(i0 + 1));}
+    };
+
+    // the same Catmull-Rom as read(), on a register of reads whose taps are gathered into y[0] to y[3]
+    template <typename SampleType>
+    inline Vec<SampleType> hermiteLanes(const Vec<SampleType>* y, Vec<SampleType> frac){
+        const auto k = [](double x) {return Vec<SampleType>::expand((SampleType) x);};
+        const Vec<SampleType> c1 = k(0.5) * (y[2] - y[0]);
+        const Vec<SampleType> c2 = y[0] - k(2.5) * y[1] + k(2) * y[2] - k(0.5) * y[3];
+        const Vec<SampleType> c3 = k(0.5) * (y[3] - y[0]) + k(1.5) * (y[1] - y[2]);
+        return ((c3 * frac + c2) * frac + c1) * frac + y[1];
+    }
+
+    // 4-point, 3rd-order Hermite (Catmull-Rom)
+    template <>
+    struct Interpolator<Interpolation::hermite>
+    {
+        static constexpr int before = 1, after = 2;
+
+        template <typename SampleType, typename Get>
+        static SampleType read(const Get& at, int i0, SampleType frac){
+            const SampleType ym1 = at(i0 - 1), y0 = at(i0), y1 = at(i0 + 1), y2 = at(i0 + 2);
+            const SampleType c1 = (SampleType) 0.5 * (y1 - ym1);
+            const SampleType c2 = ym1 - (SampleType) 2.5 * y0 + (SampleType) 2 * y1 - (SampleType) 0.5 * y2;
+            const SampleType c3 = (SampleType) 0.5 * (y2 - ym1) + (SampleType) 1.5 * (y0 - y1);
+            return ((c3 * frac + c2) * frac + c1) * frac + y0;
+        }
+    };
+
+    // polyphase windowed sinc, blending the two table rows either side of frac
+    template <int Taps>
+    struct SincInterpolator
+    {
+        static constexpr int before = Taps / 2 - 1, after = Taps / 2;
+
+        template <typename SampleType, typename Get>
+        static SampleType read(const Get& at, int i0, SampleType frac){
+            using Table = SincTable<Taps, SampleType>;
+            constexpr int lanes = numLanes<SampleType>;
+            const SampleType position = frac * (SampleType) Table::numPhases;
+            const int phase = juce::jmin((int) position, Table::numPhases - 1);
+            const SampleType blend = position - (SampleType) phase;
+            const SampleType* c0 = Table::get().row(phase);
+            const SampleType* c1 = c0 + Taps;
+            alignas (Vec<SampleType>::SIMDRegisterSize) SampleType x[Taps];
+            for (int k = 0; k < Taps; k++) x[k] = at(i0 - before + k);
+            //both rows in one pass, a register of taps at a time, and the lanes summed at the end
+            Vec<SampleType> a = Vec<SampleType>::expand(0), b = Vec<SampleType>::expand(0);
+            for (int k = 0; k < Taps; k += lanes){
+                const Vec<SampleType> taps = Vec<SampleType>::fromRawArray(x + k);
+                a += taps * Vec<SampleType>::fromRawArray(c0 + k);
+                b += taps * Vec<SampleType>::fromRawArray(c1 + k);
+            }
+            const SampleType sa = a.sum(), sb = b.sum();
+            return sa + blend * (sb - sa);
+        }
+    };
+
+    template <> struct Interpolator<Interpolation::sinc8> : SincInterpolator<8> {};
+    template <> struct Interpolator<Interpolation::sinc16> : SincInterpolator<16> {};
+
+    // the interpolated read that pairs the last sample with the first one
+    template <typename SampleType, typename Reader>
+    inline SampleType readWrapped(const Reader& fileData, int fileNumSamples, Phase p)
+    {
+        const int i0 = index(p);
+        return linearInterp(fraction<SampleType>(p), fileData[i0], fileData[(i0 + 1) % fileNumSamples]);
+    }
+
+    // out[i] = file at p + increment * i, the caller guarantees no read crosses the end of the file
+    template <typename SampleType, typename Reader>
+    inline void readRun(SampleType* out, const Reader& fileData, Phase p, Phase increment, int numSamples)
+    {
+        if constexpr (Reader::contiguous){
+            if (increment == unityIncrement){
+                const int i0 = index(p);
+                const SampleType frac = fraction<SampleType>(p);
+                juce::FloatVectorOperations::copyWithMultiply(out, fileData.data + i0, (SampleType) 1 - frac, numSamples);
+                juce::FloatVectorOperations::addWithMultiply(out, fileData.data + i0 + 1, frac, numSamples);
+                return;
+            }
+        }
+        const int done = gatherRun<0, 2, false>(out, fileData, p, increment, numSamples,
+            [](const Vec<SampleType>* y, Vec<SampleType> frac) {return y[0] + frac * (y[1] - y[0]);});
+        for (int i = done; i < numSamples; i++){
+            const int i0 = index(p);
+            out[i] = linearInterp(fraction<SampleType>(p), fileData[i0], fileData[i0 + 1]);
+            p += increment;
+        }
+    }
+
+    // out[i] += gain * file at p + increment * i, same guarantee as readRun
+    template <typename SampleType, typename Reader>
+    inline void addRun(SampleType* out, const Reader& fileData, Phase p, Phase increment, int numSamples, SampleType gain)
+    {
+        if constexpr (Reader::contiguous){
+            if (increment == unityIncrement){
+                const int i0 = index(p);
+                const SampleType frac = fraction<SampleType>(p);
+                juce::FloatVectorOperations::addWithMultiply(out, fileData.data + i0, gain * ((SampleType) 1 - frac), numSamples);
+                juce::FloatVectorOperations::addWithMultiply(out, fileData.data + i0 + 1, gain * frac, numSamples);
+                return;
+            }
+        }
+        const Vec<SampleType> g = Vec<SampleType>::expand(gain);
+        const int done = gatherRun<0, 2, true>(out, fileData, p, increment, numSamples,
+            [g](const Vec<SampleType>* y, Vec<SampleType> frac) {return g * (y[0] + frac * (y[1] - y[0]));});
+        for (int i = done; i < numSamples; i++){
+            const int i0 = index(p);
+            out[i] += gain * linearInterp(fraction<SampleType>(p), fileData[i0], fileData[i0 + 1]);
+            p += increment;
+        }
+    }
+
+    // out[i] = file at p + increment * i read with Tier, the caller guarantees no footprint crosses the end of the file
+    template <Interpolation Tier, typename SampleType, typename Reader>
+    inline void interpolateRun(SampleType* out, const Reader& fileData, Phase p, Phase increment, int numSamples)
+    {
+        if constexpr (Tier == Interpolation::linear) readRun(out, fileData, p, increment, numSamples);
+        else{
+            //Hermite runs a register of reads at a time; sinc has enough taps to fill registers within one read
+            int done = 0;
+            if constexpr (Tier == Interpolation::hermite)
+                done = gatherRun<Interpolator<Tier>::before, 4, false>(out, fileData, p, increment, numSamples, hermiteLanes<SampleType>);
+            const auto at = [&fileData](int i) {return (SampleType) fileData[i];};
+            for (int i = done; i < numSamples; i++){
+                out[i] = Interpolator<Tier>::read(at, index(p), fraction<SampleType>(p));
+                p += increment;
+            }
+        }
+    }
+
+    // a read with Tier whose footprint runs past either end of the file
+    template <Interpolation Tier, typename SampleType, typename Reader>
+    inline SampleType interpolateWrapped(const Reader& fileData, int fileNumSamples, Phase p)
+    {
+        const auto at = [&fileData, fileNumSamples](int i){
+            i %= fileNumSamples;
+            return (SampleType) fileData[i < 0 ? i + fileNumSamples : i];
+        };
+        return Interpolator<Tier>::read(at, index(p), fraction<SampleType>(p));
+    }
+
+    /** Walks numSamples reads starting at pos, `increment` apart (negative reads backwards).
+        Calls run(offset, runPos, runLength) for each stretch where every read's samples
+        [i0 - before, i0 + after] stay in the file, and wrap(offset, readPos) for a read that
+        reaches past either end. The default footprint is the linear pair [i0, i0 + 1].
+        pos is left on the read after the last one, wrapped into the file.
+    */
+    template <typename RunFn, typename WrapFn>
+    void forEachRun(Phase& pos, Phase increment, int fileNumSamples, int numSamples, RunFn&& run, WrapFn&& wrap, int before = 0, int after = 1)
+    {
+        if (fileNumSamples < 2 || increment == 0) return;
+        const Phase fileEnd = (Phase) fileNumSamples << 32;
+        const Phase firstRead = (Phase) before << 32;
+        const Phase lastRead = (Phase) (fileNumSamples - after) << 32;
+
+        int done = 0;
+        while (done < numSamples){
+            pos %= fileEnd;
+            if (pos < 0) pos += fileEnd;
+            const int remaining = numSamples - done;
+
+            //number of reads before the footprint would cross either end of the file
+            Phase untilWrap = 0;
+            if (pos >= firstRead && pos < lastRead){
+                if (increment > 0) untilWrap = (lastRead - pos + increment - 1) / increment;
+                else untilWrap = (pos - firstRead) / -increment + 1;
+            }
+            const int runLength = (int) juce::jmin((Phase) remaining, untilWrap);
+
+            if (runLength > 0) run(done, pos, runLength);
+            else wrap(done, pos);
+
+            const int advanced = juce::jmax(runLength, 1);
+            pos += increment * advanced;
+            done += advanced;
+        }
+        pos %= fileEnd;
+        if (pos < 0) pos += fileEnd;
+    }
+}
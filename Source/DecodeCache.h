@@ -0,0 +1,117 @@
+/*
+  ==============================================================================
+
+    DecodeCache.h
+    Decoded files shared by every instance, so a file is decoded once however often it is loaded.
+
+  ==============================================================================
+*/
+
+#pragma once
+
+#include <JuceHeader.h>
+#include "ReferenceCountedBuffer.h"
+
+//==============================================================================
+/**
+    The sample browser previews files and the loader plays them, and both go
+    through here. A file is known by its path, size and modification time, so
+    an edited file is decoded again. Buffers are kept in the storage they were
+    asked for, because compacting changes what the grains read.
+
+    The most recently used buffers are kept up to budgetBytes. Dropping one
+    only drops the cache's reference; an instance still playing it keeps it.
+
+    One cache is shared by every instance in the process through
+    juce::SharedResourcePointer. Only call it from loader threads, since a miss
+    decodes the file in the caller.
+*/
+class DecodeCache
+{
+public:
+    static constexpr size_t budgetBytes = (size_t) 512 << 20;
+
+    struct Decoded
+    {
+        ReferenceCountedBuffer::Ptr buffer;
+        double sampleRate = 0;
+    };
+
+    // the decoded file, from the cache or read now; no buffer when the file can't be read
+    Decoded get(const juce::File& file, SampleStorage storage){
+        const Key key {file.getFullPathName(), file.getSize(), file.getLastModificationTime().toMilliseconds(), storage};
+        {
+            const juce::ScopedLock sl(lock);
+            if (const Decoded* hit = find(key)) return *hit;
+        }
+        const Decoded decoded = decode(file, storage);
+        if (decoded.buffer == nullptr) return decoded;
+        const juce::ScopedLock sl(lock);
+        //another loader may have decoded the same file meanwhile
+        if (const Decoded* hit = find(key)) return *hit;
+        entries.insert(entries.begin(), {key, decoded});
+        trim();
+        return decoded;
+    }
+
+    // drops every buffer the cache holds, the ones still in use stay alive
+    void clear(){
+        const juce::ScopedLock sl(lock);
+        entries.clear();
+    }
+
+private:
+    struct Key
+    {
+        juce::String path;
+        juce::int64 size, modified;
+        SampleStorage storage;
+
+        bool operator== (const Key& o) const {return size == o.size && modified == o.modified && storage == o.storage && path == o.path;}
+    };
+    struct Entry
+    {
+        Key key;
+        Decoded decoded;
+    };
+
+    // moves a hit to the front, so the back holds the least recently used
+    const Decoded* find(const Key& key){
+        for (size_t i = 0; i < entries.size(); i++){
+            if (entries[i].key == key){
+                std::rotate(entries.begin(), entries.begin() + (long) i, entries.begin() + (long) i + 1);
+                return &entries.front().decoded;
+            }
+        }
+        return nullptr;
+    }
+
+    void trim(){
+        size_t total = 0;
+        for (size_t i = 0; i < entries.size(); i++){
+            total += entries[i].decoded.buffer->getMemorySize();
+            //the newest entry always stays, however big
+            if (i > 0 && total > budgetBytes){
+                entries.resize(i);
+                return;
+            }
+        }
+    }
+
+    static Decoded decode(const juce::File& file, SampleStorage storage){
+        juce::AudioFormatManager formats;
+        formats.registerBasicFormats();
+        std::unique_ptr<juce::AudioFormatReader> reader (formats.createReaderFor(file));
+        if (reader == nullptr || reader->lengthInSamples <= 0 || reader->lengthInSamples > std::numeric_limits<int>::max()) return {};
+        const int numSamples = (int) reader->lengthInSamples;
+        Decoded decoded;
+        decoded.buffer = new ReferenceCountedBuffer(file.getFileName(), (int) reader->numChannels, numSamples);
+        decoded.sampleRate = reader->sampleRate;
+        reader->read(decoded.buffer->get(), 0, numSamples, 0, true, true);
+        decoded.buffer->compact(storage);
+        return decoded;
+    }
+
+    juce::CriticalSection lock;
+    std::vector<Entry> entries;
+};
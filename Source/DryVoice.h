@@ -0,0 +1,62 @@
+/*
+  ==============================================================================
+
+    DryVoice.h
+    The un-granulated playhead that is blended in under the grains.
+
+  ==============================================================================
+*/
+
+#pragma once
+
+#include <JuceHeader.h>
+#include "CircularRead.h"
+#include "ReferenceCountedBuffer.h"
+
+//==============================================================================
+/**
+    Plays the file from a circular playhead, a whole block at a time.
+
+    Wrap points are found once per run, so the inner loops read a contiguous
+    stretch of the file with no modulo and no per-sample direction checks.
+*/
+class DryVoice
+{
+public:
+    void setPosition(double newPos) {pos = CircularRead::toPhase(newPos);}
+    double getPosition() const {return CircularRead::toSamples(pos);}
+
+    // adds gain * file into dest, reading `step` file samples per output sample (negative plays backwards)
+    template <typename SampleType>
+    void addTo(juce::AudioBuffer<SampleType>& dest, int startSample, int numSamples, const ReferenceCountedBuffer& file, double step, SampleType gain)
+    {
+        switch (file.getStorage()){
+            case SampleStorage::interleavedInt16: addFrom<SampleStorage::interleavedInt16>(dest, startSample, numSamples, file, step, gain); break;
+            case SampleStorage::interleavedHalf: addFrom<SampleStorage::interleavedHalf>(dest, startSample, numSamples, file, step, gain); break;
+            default: addFrom<SampleStorage::planarFloat>(dest, startSample, numSamples, file, step, gain); break;
+        }
+    }
+
+private:
+    template <SampleStorage Storage, typename SampleType>
+    void addFrom(juce::AudioBuffer<SampleType>& dest, int startSample, int numSamples, const ReferenceCountedBuffer& file, double step, SampleType gain)
+    {
+        const int fileNumSamples = file.getNumSamples();
+        const int fileNumChannels = file.getNumChannels();
+        if (fileNumChannels == 0) return;
+
+        const CircularRead::Phase increment = CircularRead::toPhase(step);
+        CircularRead::forEachRun(pos, increment, fileNumSamples, numSamples,
+            [&](int offset, CircularRead::Phase p, int run){
+                for (int c = 0; c < dest.getNumChannels(); c++)
+                    CircularRead::addRun(dest.getWritePointer(c, startSample + offset), file.getReader<SampleType, Storage>(c % fileNumChannels), p, increment, run, gain);
+            },
+            [&](int offset, CircularRead::Phase p){
+                for (int c = 0; c < dest.getNumChannels(); c++)
+                    dest.getWritePointer(c, startSample + offset)[0] += gain * CircularRead::readWrapped<SampleType>(file.getReader<SampleType, Storage>(c % fileNumChannels), fileNumSamples, p);
+            });
+    }
+
+    //32.32 fixed point, so a long run keeps exact pitch
+    CircularRead::Phase pos = 0;
+};
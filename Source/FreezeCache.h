@@ -0,0 +1,248 @@
+/*
+  ==============================================================================
+
+    FreezeCache.h
+    Pre-rendered loop of a cloud that has stopped changing.
+
+  ==============================================================================
+*/
+
+#pragma once
+
+#include <JuceHeader.h>
+#include "ReferenceCountedBuffer.h"
+#include "GrainVoice.h"
+#include "ModMatrix.h"
+#include "Spatializer.h"
+#include "SourceIndex.h"
+
+//==============================================================================
+// What the cloud is built from. When none of it changes, a loop of the cloud sounds the same as rendering it.
+struct FreezeKey
+{
+    GrainParams params;
+    ModMatrix::Settings mods;
+    const ReferenceCountedBuffer* source = nullptr;
+    int numChannels = 0;
+    int notes = 0;          //bumped by every note event
+    float seconds = 0;      //loop length
+
+    bool operator== (const FreezeKey& o) const{
+        return source == o.source && numChannels == o.numChannels && notes == o.notes && seconds == o.seconds
+            && params == o.params && mods == o.mods;
+    }
+};
+
+//==============================================================================
+// Everything the background render needs, copied from the audio thread in one go.
+struct FreezeRequest
+{
+    GrainVoice voices[GrainVoice::maxVoices];
+    ModMatrix::Settings mods;
+    SpeakerLayout layout;
+    ReferenceCountedBuffer::Ptr source;
+    SourceIndex::Ptr index;    //null until the file has been analysed
+    int numChannels = 0;
+    long long int start = 0;   //engine time the render starts at
+    int warmUp = 0;            //samples thrown away while the cloud fills up
+    int loopLength = 0;
+    int fadeLength = 0;        //the tail rendered past the loop and crossfaded onto its head
+    int generation = 0;
+};
+
+//==============================================================================
+/**
+    A rendered loop. The audio after the loop end is faded into its start
+    with an equal-power crossfade, so the seam sounds like the cloud just
+    carrying on. Loop sample 0 sits at engine time `origin`, so playback
+    picks up wherever the clock is.
+*/
+class FrozenCloud : public juce::ReferenceCountedObject
+{
+public:
+    typedef juce::ReferenceCountedObjectPtr<FrozenCloud> Ptr;
+
+    FrozenCloud(const juce::AudioBuffer<float>& rendered, int warmUp, int loopLength, int fadeLength, long long int loopOrigin, int renderGeneration):
+    origin(loopOrigin), generation(renderGeneration)
+    {
+        audio.setSize(rendered.getNumChannels(), loopLength);
+        for (int c = 0; c < rendered.getNumChannels(); c++){
+            audio.copyFrom(c, 0, rendered, c, warmUp, loopLength);
+            float* out = audio.getWritePointer(c);
+            const float* tail = rendered.getReadPointer(c, warmUp + loopLength);
+            for (int i = 0; i < fadeLength; i++){
+                const float x = (i + 0.5f) / fadeLength * juce::MathConstants<float>::halfPi;
+                out[i] = out[i] * std::sin(x) + tail[i] * std::cos(x);
+            }
+        }
+    }
+
+    // adds the loop at engine time `time` into dest with a gain ramp from g0 to g1
+    template <typename SampleType>
+    void addTo(juce::AudioBuffer<SampleType>& dest, long long int time, float g0, float g1) const
+    {
+        const int length = audio.getNumSamples();
+        const int numSamples = dest.getNumSamples();
+        if (length == 0 || numSamples == 0 || dest.getNumChannels() != audio.getNumChannels()) return;
+        long long int start = (time - origin) % length;
+        if (start < 0) start += length;
+        const float step = (g1 - g0) / numSamples;
+        for (int c = 0; c < dest.getNumChannels(); c++){
+            const float* src = audio.getReadPointer(c);
+            SampleType* out = dest.getWritePointer(c);
+            int i = (int) start;
+            float g = g0;
+            for (int s = 0; s < numSamples; s++){
+                out[s] += (SampleType) (g * src[i]);
+                g += step;
+                if (++i == length) i = 0;
+            }
+        }
+    }
+
+    const long long int origin;
+    const int generation;
+
+private:
+    juce::AudioBuffer<float> audio;
+};
+
+//==============================================================================
+/**
+    Watches the cloud from the audio thread and swaps in a loop of it once it
+    has held still for settleSeconds.
+
+    - The audio thread fills one FreezeRequest slot.
+    - The scheduler thread takes the request and starts a background render.
+    - The render publishes the loop.
+    - The audio thread fades it in.
+
+    Any change bumps the generation. That drops a render in flight, and it
+    fades straight back to the live grains, which never stopped being
+    spawned. Every loop stays in `clouds` until only that array refers to
+    it. So the audio thread never frees one, and the scheduler thread does.
+*/
+class FreezeCache
+{
+public:
+    static constexpr double settleSeconds = 0.5;
+    static constexpr double fadeSeconds = 0.25;
+    static constexpr double warmUpSeconds = 4.5;    //longer than the longest grain
+
+    // call from prepareToPlay, never while the audio thread is running
+    void prepare(int numChannels, int maxBlockSize, double sampleRate){
+        scratchFloat.setSize(numChannels, maxBlockSize);
+        scratchDouble.setSize(numChannels, maxBlockSize);
+        fadeSamples = (float) (fadeSeconds * sampleRate);
+        settleSamples = (long long int) (settleSeconds * sampleRate);
+        invalidate();
+        mix = 0;
+        active = nullptr;
+    }
+
+    //==============================================================================
+    // audio thread, once per block
+    void update(const FreezeKey& key, bool allowed, long long int time){
+        const bool changed = !(key == lastKey);
+        if (changed){
+            lastKey = key;
+            stableSince = time;
+        }
+        if (changed || !allowed){
+            invalidate();
+            return;
+        }
+        const juce::SpinLock::ScopedTryLockType tl(publishLock);
+        if (tl.isLocked() && published != nullptr){
+            if (published->generation == generation.load()){
+                active = published;
+                target = 1;
+            }
+            published = nullptr;
+        }
+    }
+
+    // audio thread, the cloud changed: any render in flight is dropped and the live grains fade back in
+    void invalidate(){
+        if (!requested && target == 0) return;
+        ++generation;
+        requested = false;
+        target = 0;
+    }
+
+    // audio thread: the slot to fill when the cloud has settled, null otherwise. Call postRequest() once it is filled.
+    FreezeRequest* beginRequest(long long int time){
+        if (requested || target > 0 || time - stableSince < settleSamples || requestPending.load()) return nullptr;
+        request.generation = generation.load();
+        return &request;
+    }
+    void postRequest(){
+        requested = true;
+        requestPending.store(true);
+    }
+
+    // audio thread: the loop's gain over the next numSamples, from m0 to m1
+    void advance(int numSamples, float& m0, float& m1){
+        m0 = mix;
+        if (active == nullptr) target = 0;
+        const float delta = fadeSamples > 0 ? numSamples / fadeSamples : 1.0f;
+        mix = target > mix ? juce::jmin(target, mix + delta) : juce::jmax(target, mix - delta);
+        m1 = mix;
+        if (mix == 0 && target == 0) active = nullptr;
+    }
+    template <typename SampleType>
+    void addFrozen(juce::AudioBuffer<SampleType>& dest, long long int time, float m0, float m1) const{
+        if (active != nullptr) active->addTo(dest, time, m0, m1);
+    }
+    // audio thread: room for the live grains while they fade against the loop
+    template <typename SampleType>
+    juce::AudioBuffer<SampleType>& getScratch(){
+        if constexpr (std::is_same_v<SampleType, double>) return scratchDouble;
+        else return scratchFloat;
+    }
+
+    //==============================================================================
+    // scheduler thread: copies out a posted request and frees the slot
+    bool takeRequest(FreezeRequest& out){
+        if (!requestPending.load()) return false;
+        out = request;
+        request.source = nullptr;
+        request.index = nullptr;
+        requestPending.store(false);
+        return true;
+    }
+    // scheduler thread
+    void freeUnusedClouds(){
+        for (int i = clouds.size() - 1; i >= 0; i--){
+            if (clouds.getUnchecked(i)->getReferenceCount() == 1) clouds.remove(i);
+        }
+    }
+    bool hasClouds() const {return clouds.size() > 0;}
+
+    // render thread
+    int getGeneration() const {return generation.load();}
+    void publish(FrozenCloud::Ptr cloud){
+        clouds.add(cloud.get());
+        const juce::SpinLock::ScopedLockType sl(publishLock);
+        published = cloud;
+    }
+
+private:
+    //audio thread
+    FreezeKey lastKey;
+    long long int stableSince = 0;
+    long long int settleSamples = 0;
+    bool requested = false;
+    float mix = 0, target = 0, fadeSamples = 0;
+    FrozenCloud::Ptr active;
+    juce::AudioBuffer<float> scratchFloat;
+    juce::AudioBuffer<double> scratchDouble;
+
+    //shared
+    std::atomic<int> generation {0};
+    FreezeRequest request;
+    std::atomic<bool> requestPending {false};
+    FrozenCloud::Ptr published;
+    juce::SpinLock publishLock;
+    juce::ReferenceCountedArray<FrozenCloud, juce::CriticalSection> clouds;
+};
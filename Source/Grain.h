@@ -0,0 +1,409 @@
+/*
+  ==============================================================================
+
+    Grain.h
+    A single scheduled grain and its render kernels.
+
+  ==============================================================================
+*/
+
+#pragma once
+
+#include <JuceHeader.h>
+#include "CircularRead.h"
+#include "ReferenceCountedBuffer.h"
+#include "GrainSnapshot.h"
+#include "Spatializer.h"
+
+//==============================================================================
+// State-variable filter coefficients for one grain, worked out when it is scheduled.
+// The filter state lives in a GrainFilterBank, which runs the filters of several grains side by side.
+struct GrainFilter
+{
+    enum Mode {off, lowpass, bandpass, highpass};
+
+    bool active = false;
+    double a1 = 0, a2 = 0, a3 = 0;   //trapezoidal integrator coefficients, narrowed to the block's type when it is filtered
+    double m0 = 0, m1 = 0, m2 = 0;   //output = m0 * input + m1 * band + m2 * low
+    float peakGain = 1;              //the most any frequency is boosted, about the resonance once it rises
+
+    static GrainFilter make(int mode, float cutoff, float resonance, double sampleRate){
+        GrainFilter f;
+        if (mode == off || sampleRate <= 0) return f;
+        const double g = std::tan(juce::MathConstants<double>::pi * juce::jlimit(10.0, 0.49 * sampleRate, (double) cutoff) / sampleRate);
+        const double k = 1.0 / juce::jmax(0.1f, resonance);
+        f.active = true;
+        f.a1 = 1.0 / (1.0 + g * (g + k));
+        f.a2 = g * f.a1;
+        f.a3 = g * f.a2;
+        switch (mode){
+            case lowpass: f.m2 = 1; break;
+            case bandpass: f.m1 = 1; break;
+            default: f.m0 = 1; f.m1 = -k; f.m2 = -1; break;
+        }
+        //the band output peaks at 1 / k on the cutoff, low and high pass only peak once q passes 1 / sqrt 2
+        const float q = juce::jmax(0.1f, resonance);
+        if (mode == bandpass) f.peakGain = q;
+        else if (q * q > 0.5f) f.peakGain = q * q / std::sqrt(q * q - 0.25f);
+        return f;
+    }
+};
+
+//==============================================================================
+/**
+    A grain is fixed once it is scheduled. Its direction, envelope shape, rate,
+    channel layout and the file's storage format pick one specialised render
+    kernel at construction, so the loops that run per sample carry none of
+    those branches. The interpolation tier is picked once per chunk, and only
+    for grains that read between samples.
+*/
+class Grain
+{
+public:
+    const long long int onset;
+    const int length;
+    const int startPos;
+
+
+    const float envAttack, envAttackRecip;
+    const float envRelease, envReleaseRecip;
+    const float envCurve;
+    const float lengthRecip;
+
+
+    const float rate;
+    // rate in 32.32 fixed point, the read position is startPos + d * phaseIncrement without any float rounding
+    const CircularRead::Phase phaseIncrement;
+    const float amp;
+    const bool rev;
+    const int grainLengthInSample;
+
+    // audible window relative to onset, everything outside stays under the cull threshold even at the filter's peak
+    const int audibleStart;
+    const int audibleEnd;
+
+    // envelope phases in samples from onset: attack is [0, attackEndSample), release starts at releaseStartSample
+    const int attackEndSample;
+    const int releaseStartSample;
+    const float attackSlope;
+    const float curveNorm;
+
+    // layout the kernel was specialised for, 0 means any
+    const int srcChannels;
+    const int dstChannels;
+    const SampleStorage storage;
+    // where each source channel lands and how loud, no routes keeps the channel % numSrc mapping
+    const SpatialRoutes routes;
+    const GrainFilter filter;
+    const CircularRead::Interpolation interpolation;
+
+
+    Grain(): onset(0),length(1000), startPos(0), envAttack(0.3), envAttackRecip(1/envAttack), envRelease(0.7), envReleaseRecip(1/(1-envRelease)),envCurve(0.0), lengthRecip(1.0f/length), rate(1.0), phaseIncrement(CircularRead::unityIncrement), amp(1.0), rev(false), grainLengthInSample(int(length/rate)), audibleStart(0), audibleEnd(length),
+    attackEndSample(phaseEnd(length, envAttack)), releaseStartSample(juce::jmax(attackEndSample, phaseStart(length, envRelease))),
+    attackSlope(lengthRecip * envAttackRecip), curveNorm(1.0f), srcChannels(0), dstChannels(0), storage(SampleStorage::planarFloat), routes(), filter(), interpolation(CircularRead::Interpolation::linear),
+    renderFloat(selectKernel<float>(storage, false, false, true, 0, 0)), renderDouble(selectKernel<double>(storage, false, false, true, 0, 0)),
+    readFloat(selectReader<float>(storage, false, true)), readDouble(selectReader<double>(storage, false, true))
+    {}
+    ~Grain(){}
+    Grain(long long int onset,int length,int startPos,float envAttack=0.3, float envR=0.3, float envCurve = 0.0, float rate=1.0, float amp = 1.0, bool reverse = false, float cullThreshold = 0.0f, int fileNumChannels = 0, int outNumChannels = 0, SampleStorage fileStorage = SampleStorage::planarFloat, const SpatialRoutes& spatialRoutes = {}, const GrainFilter& grainFilter = {}, CircularRead::Interpolation quality = CircularRead::Interpolation::linear): onset(onset), length(length), startPos(startPos), envAttack(envAttack), envAttackRecip(1/envAttack), envRelease(1-envR), envReleaseRecip(1/envR), envCurve(envCurve), lengthRecip(1/(float)length), rate(rate), phaseIncrement(CircularRead::toPhase(rate)), amp(amp), rev(reverse), grainLengthInSample(int(length/rate)),
+    audibleStart(cullStart(length, envAttack, envCurve, amp * grainFilter.peakGain, cullThreshold)),
+    audibleEnd(cullEnd(length, envR, envCurve, amp * grainFilter.peakGain, cullThreshold)),
+    attackEndSample(phaseEnd(length, envAttack)),
+    releaseStartSample(juce::jmax(attackEndSample, phaseStart(length, 1 - envR))),
+    attackSlope(lengthRecip * envAttackRecip),
+    curveNorm(isCurved(envCurve) ? 1.0f / (1.0f - std::exp(envCurve)) : 1.0f),
+    srcChannels(fileNumChannels), dstChannels(outNumChannels), storage(fileStorage), routes(spatialRoutes), filter(grainFilter), interpolation(quality),
+    renderFloat(selectKernel<float>(fileStorage, reverse, isCurved(envCurve), rate == 1.0f, fileNumChannels, outNumChannels)),
+    renderDouble(selectKernel<double>(fileStorage, reverse, isCurved(envCurve), rate == 1.0f, fileNumChannels, outNumChannels)),
+    readFloat(selectReader<float>(fileStorage, reverse, rate == 1.0f)),
+    readDouble(selectReader<double>(fileStorage, reverse, rate == 1.0f))
+    {
+
+    }
+    bool isCulled() const {return audibleStart >= audibleEnd;}
+    long long int end() const {return onset + audibleEnd;}
+
+    // inverse of the envelope shape: returns the phase g in [0, 1] where shape(g) == gain
+    static float inverseShape(float gain, float curve){
+        if (isCurved(curve)) return std::log(1.0 - gain * (1.0 - exp(curve))) / curve;
+        return gain;
+    }
+    // first sample (from onset) where amp * envelope reaches the threshold
+    static int cullStart(int length, float attack, float curve, float amp, float threshold){
+        if (threshold <= 0.0f) return 0;
+        if (amp <= threshold) return length;
+        const float g = inverseShape(threshold / amp, curve);
+        return juce::jlimit(0, length, (int) std::floor(g * attack * length));
+    }
+    // one past the last sample where amp * envelope stays above the threshold
+    static int cullEnd(int length, float release, float curve, float amp, float threshold){
+        if (threshold <= 0.0f) return length;
+        if (amp <= threshold) return length;
+        const float g = inverseShape(threshold / amp, curve);
+        return juce::jlimit(0, length, (int) std::ceil((1.0f - g * release) * length) + 1);
+    }
+    float envelope(long long int time) const{
+
+        //curve method
+        // if c != 0 => gain = (1 - e^fc) / (1 - e^c)
+        // f is fraction of position in curve (from the lowest point)
+        float gain = 0;
+        float envPos = (float)(time - onset) * lengthRecip;
+        if(envPos <= envAttack){
+            gain = envPos * envAttackRecip;
+            if(isCurved(envCurve)) return (1.0 - exp(gain * envCurve)) / (1.0 - exp(envCurve));
+            return gain;
+        }else if (envPos >= envRelease){
+            gain = (1-envPos) * envReleaseRecip;
+            if (isCurved(envCurve)) return (1.0 - exp(gain * envCurve)) / (1.0 - exp(envCurve));
+            return gain;
+        }else return 1.0;
+    }
+
+    // what the editor draws for this grain at `time`, the envelope is left uncurved so it costs no exp()
+    GrainSnapshot::Entry snapshotAt(long long int time, float fileRecip) const{
+        const float elapsed = (float) (time - onset);
+        const float envPos = elapsed * lengthRecip;
+        const float shape = juce::jlimit(0.0f, 1.0f, juce::jmin(envPos * envAttackRecip, (1 - envPos) * envReleaseRecip));
+        const float dir = rev ? -1.0f : 1.0f;
+        const float start = startPos * fileRecip;
+        float head = start + dir * rate * elapsed * fileRecip;
+        head -= std::floor(head);
+        return {start, dir * rate * length * fileRecip, head, amp * shape};
+    }
+
+    // adds the part of the grain that overlaps [blockStart, blockStart + block.getNumSamples()) into block
+    template <typename SampleType>
+    void render (juce::AudioBuffer<SampleType>& block, const ReferenceCountedBuffer& file, long long int blockStart) const
+    {
+        const long long int from = juce::jmax(blockStart, onset + firstSample());
+        const long long int to = juce::jmin(blockStart + block.getNumSamples(), end());
+        if (from >= to || file.getNumSamples() < 2) return;
+
+        RenderFn<SampleType> fn;
+        if constexpr (std::is_same_v<SampleType, double>) fn = renderDouble;
+        else fn = renderFloat;
+        //the file or the bus changed since the grain was scheduled
+        if (file.getNumChannels() != srcChannels || block.getNumChannels() != dstChannels || file.getStorage() != storage)
+            fn = selectKernel<SampleType>(file.getStorage(), rev, isCurved(envCurve), rate == 1.0f, 0, 0);
+        fn(*this, block, (int)(from - blockStart), file, (int)(from - onset), (int)(to - from));
+    }
+
+    //==============================================================================
+    // Filtered grains are rendered in three steps, so a GrainFilterBank can run the filter of several grains at once.
+
+    // first sample (from onset) that is rendered
+    int firstSample() const {return audibleStart + 1;}
+
+    // where the grain sounds in a block of numSamples at blockStart: block offset, samples from onset and count
+    bool window(long long int blockStart, int numSamples, int& offset, int& d0, int& count) const{
+        const long long int from = juce::jmax(blockStart, onset + firstSample());
+        const long long int to = juce::jmin(blockStart + numSamples, end());
+        if (from >= to) return false;
+        offset = (int) (from - blockStart);
+        d0 = (int) (from - onset);
+        count = (int) (to - from);
+        return true;
+    }
+
+    // how many source channels are read and filtered separately
+    int numSources(const ReferenceCountedBuffer& file, int numOutputs) const{
+        const int numSrc = file.getNumChannels();
+        if (routes.numRoutes > 0) return juce::jmin(numSrc, 2);
+        return juce::jmin(numSrc, numOutputs);
+    }
+
+    // 1. the unenveloped source channel, d0 .. d0 + numSamples from onset
+    template <typename SampleType>
+    void readRaw(const ReferenceCountedBuffer& file, int source, SampleType* out, int d0, int numSamples) const{
+        ReadFn<SampleType> fn;
+        if constexpr (std::is_same_v<SampleType, double>) fn = readDouble;
+        else fn = readFloat;
+        if (file.getStorage() != storage) fn = selectReader<SampleType>(file.getStorage(), rev, rate == 1.0f);
+        fn(*this, file, source, out, d0, numSamples);
+    }
+
+    // 2. amp * envelope over the same samples
+    template <typename SampleType>
+    void fillGain(SampleType* gain, int d0, int numSamples) const{
+        if (isCurved(envCurve)) fillEnvelope<true>(gain, d0, numSamples);
+        else fillEnvelope<false>(gain, d0, numSamples);
+    }
+
+    // 3. adds one processed source channel to the outputs it feeds
+    template <typename SampleType>
+    void addSource(juce::AudioBuffer<SampleType>& block, int blockOffset, int source, int numFileChannels, const SampleType* signal, int numSamples) const{
+        if (routes.numRoutes > 0){
+            for (int r = 0; r < routes.numRoutes; r++){
+                const SpatialRoutes::Route& route = routes.route[r];
+                if (route.src == source && route.dst < block.getNumChannels())
+                    juce::FloatVectorOperations::addWithMultiply(block.getWritePointer(route.dst, blockOffset), signal, (SampleType) route.gain, numSamples);
+            }
+            return;
+        }
+        for (int c = source; c < block.getNumChannels(); c += numFileChannels)
+            juce::FloatVectorOperations::add(block.getWritePointer(c, blockOffset), signal, numSamples);
+    }
+
+private:
+    template <typename SampleType>
+    using RenderFn = void (*)(const Grain&, juce::AudioBuffer<SampleType>&, int, const ReferenceCountedBuffer&, int, int);
+    RenderFn<float> renderFloat;
+    RenderFn<double> renderDouble;
+    template <typename SampleType>
+    using ReadFn = void (*)(const Grain&, const ReferenceCountedBuffer&, int, SampleType*, int, int);
+    ReadFn<float> readFloat;
+    ReadFn<double> readDouble;
+
+    static constexpr int chunkSize = 256;
+
+    static bool isCurved(float curve) {return std::abs(curve) > 0.001;}
+    static int phaseEnd(int length, float frac) {return (int) std::floor(frac * length) + 1;}
+    static int phaseStart(int length, float frac) {return (int) std::ceil(frac * length);}
+
+    template <bool Curved, typename SampleType>
+    inline SampleType shape(SampleType g) const{
+        if constexpr (Curved) return ((SampleType) 1 - std::exp(g * (SampleType) envCurve)) * (SampleType) curveNorm;
+        else return g;
+    }
+
+    // amp * envelope for the samples d0 .. d0 + numSamples from onset, split by phase instead of tested per sample
+    template <bool Curved, typename SampleType>
+    void fillEnvelope(SampleType* gain, int d0, int numSamples) const{
+        const int attackEnd = juce::jlimit(0, numSamples, attackEndSample - d0);
+        const int releaseStart = juce::jlimit(attackEnd, numSamples, releaseStartSample - d0);
+        for (int i = 0; i < attackEnd; i++)
+            gain[i] = shape<Curved>((SampleType)(d0 + i) * (SampleType) attackSlope);
+        juce::FloatVectorOperations::fill(gain + attackEnd, (SampleType) 1, releaseStart - attackEnd);
+        for (int i = releaseStart; i < numSamples; i++)
+            gain[i] = shape<Curved>(((SampleType) 1 - (SampleType)(d0 + i) * (SampleType) lengthRecip) * (SampleType) envReleaseRecip);
+        juce::FloatVectorOperations::multiply(gain, (SampleType) amp, numSamples);
+    }
+
+    // the file from startPos, d0 .. d0 + numSamples samples in, moving `increment` file samples per output sample
+    template <bool Rev, bool Unity, typename SampleType, typename Reader>
+    static void readSource(SampleType* out, const Reader& fileData, int fileNumSamples, int startPos, CircularRead::Phase increment,
+                           CircularRead::Interpolation interpolation, int d0, int numSamples){
+        if constexpr (Unity){
+            //whole samples, so no interpolation and plain copies between wrap points
+            int idx = (startPos + (Rev ? -d0 : d0)) % fileNumSamples;
+            if (idx < 0) idx += fileNumSamples;
+            for (int i = 0; i < numSamples;){
+                const int run = juce::jmin(numSamples - i, Rev ? idx + 1 : fileNumSamples - idx);
+                if constexpr (Rev){
+                    for (int k = 0; k < run; k++) out[i + k] = fileData[idx - k];
+                    idx = fileNumSamples - 1;
+                }else{
+                    if constexpr (Reader::contiguous) juce::FloatVectorOperations::copy(out + i, fileData.data + idx, run);
+                    else for (int k = 0; k < run; k++) out[i + k] = fileData[idx + k];
+                    idx = 0;
+                }
+                i += run;
+            }
+        }else{
+            const CircularRead::Phase step = Rev ? -increment : increment;
+            const CircularRead::Phase pos = ((CircularRead::Phase) startPos << 32) + step * d0;
+            switch (interpolation){
+                case CircularRead::Interpolation::hermite: readInterpolated<CircularRead::Interpolation::hermite>(out, fileData, fileNumSamples, pos, step, numSamples); break;
+                case CircularRead::Interpolation::sinc8: readInterpolated<CircularRead::Interpolation::sinc8>(out, fileData, fileNumSamples, pos, step, numSamples); break;
+                case CircularRead::Interpolation::sinc16: readInterpolated<CircularRead::Interpolation::sinc16>(out, fileData, fileNumSamples, pos, step, numSamples); break;
+                default: readInterpolated<CircularRead::Interpolation::linear>(out, fileData, fileNumSamples, pos, step, numSamples); break;
+            }
+        }
+    }
+
+    template <CircularRead::Interpolation Tier, typename SampleType, typename Reader>
+    static void readInterpolated(SampleType* out, const Reader& fileData, int fileNumSamples, CircularRead::Phase pos, CircularRead::Phase step, int numSamples){
+        using Footprint = CircularRead::Interpolator<Tier>;
+        CircularRead::forEachRun(pos, step, fileNumSamples, numSamples,
+            [&](int offset, CircularRead::Phase p, int run){ CircularRead::interpolateRun<Tier>(out + offset, fileData, p, step, run); },
+            [&](int offset, CircularRead::Phase p){ out[offset] = CircularRead::interpolateWrapped<Tier, SampleType>(fileData, fileNumSamples, p); },
+            Footprint::before, Footprint::after);
+    }
+
+    template <typename SampleType, SampleStorage Storage, bool Rev, bool Curved, bool Unity, int SrcCh, int DstCh>
+    static void renderKernel(const Grain& g, juce::AudioBuffer<SampleType>& block, int blockOffset, const ReferenceCountedBuffer& file, int d0, int numSamples){
+        const int numSrc = SrcCh > 0 ? SrcCh : file.getNumChannels();
+        const int numDst = DstCh > 0 ? DstCh : block.getNumChannels();
+        const int fileNumSamples = file.getNumSamples();
+        SampleType gain[chunkSize];
+        SampleType read[chunkSize];
+
+        for (int done = 0; done < numSamples; done += chunkSize){
+            const int n = juce::jmin(chunkSize, numSamples - done);
+            const int d = d0 + done;
+            g.fillEnvelope<Curved>(gain, d, n);
+            if (g.routes.numRoutes > 0){
+                //each source is read and enveloped once, then added to its outputs with the pan gains
+                const int numRouted = SrcCh > 0 ? SrcCh : juce::jmin(numSrc, 2);
+                for (int s = 0; s < numRouted; s++){
+                    readSource<Rev, Unity>(read, file.getReader<SampleType, Storage>(s % numSrc), fileNumSamples, g.startPos, g.phaseIncrement, g.interpolation, d, n);
+                    juce::FloatVectorOperations::multiply(read, gain, n);
+                    for (int r = 0; r < g.routes.numRoutes; r++){
+                        const SpatialRoutes::Route& route = g.routes.route[r];
+                        if (route.src == s && route.dst < block.getNumChannels())
+                            juce::FloatVectorOperations::addWithMultiply(block.getWritePointer(route.dst, blockOffset + done), read, (SampleType) route.gain, n);
+                    }
+                }
+            }else if constexpr (SrcCh == 1){
+                //a mono file is read once and feeds every output
+                readSource<Rev, Unity>(read, file.getReader<SampleType, Storage>(0), fileNumSamples, g.startPos, g.phaseIncrement, g.interpolation, d, n);
+                juce::FloatVectorOperations::multiply(read, gain, n);
+                for (int c = 0; c < numDst; c++)
+                    juce::FloatVectorOperations::add(block.getWritePointer(c, blockOffset + done), read, n);
+            }else{
+                for (int c = 0; c < numDst; c++){
+                    readSource<Rev, Unity>(read, file.getReader<SampleType, Storage>(c % numSrc), fileNumSamples, g.startPos, g.phaseIncrement, g.interpolation, d, n);
+                    juce::FloatVectorOperations::addWithMultiply(block.getWritePointer(c, blockOffset + done), read, gain, n);
+                }
+            }
+        }
+    }
+
+    template <typename SampleType, SampleStorage Storage, bool Rev, bool Curved, bool Unity>
+    static RenderFn<SampleType> selectLayout(int src, int dst){
+        if (src == 1 && dst == 1) return &renderKernel<SampleType, Storage, Rev, Curved, Unity, 1, 1>;
+        if (src == 1 && dst == 2) return &renderKernel<SampleType, Storage, Rev, Curved, Unity, 1, 2>;
+        if (src == 2 && dst == 1) return &renderKernel<SampleType, Storage, Rev, Curved, Unity, 2, 1>;
+        if (src == 2 && dst == 2) return &renderKernel<SampleType, Storage, Rev, Curved, Unity, 2, 2>;
+        return &renderKernel<SampleType, Storage, Rev, Curved, Unity, 0, 0>;
+    }
+    template <typename SampleType, SampleStorage Storage, bool Rev, bool Curved>
+    static RenderFn<SampleType> selectRate(bool unity, int src, int dst){
+        return unity ? selectLayout<SampleType, Storage, Rev, Curved, true>(src, dst) : selectLayout<SampleType, Storage, Rev, Curved, false>(src, dst);
+    }
+    template <typename SampleType, SampleStorage Storage, bool Rev>
+    static RenderFn<SampleType> selectCurve(bool curved, bool unity, int src, int dst){
+        return curved ? selectRate<SampleType, Storage, Rev, true>(unity, src, dst) : selectRate<SampleType, Storage, Rev, false>(unity, src, dst);
+    }
+    template <typename SampleType, SampleStorage Storage>
+    static RenderFn<SampleType> selectDirection(bool reverse, bool curved, bool unity, int src, int dst){
+        return reverse ? selectCurve<SampleType, Storage, true>(curved, unity, src, dst) : selectCurve<SampleType, Storage, false>(curved, unity, src, dst);
+    }
+    template <typename SampleType, SampleStorage Storage, bool Rev, bool Unity>
+    static void readKernel(const Grain& g, const ReferenceCountedBuffer& file, int source, SampleType* out, int d0, int numSamples){
+        readSource<Rev, Unity>(out, file.getReader<SampleType, Storage>(source), file.getNumSamples(), g.startPos, g.phaseIncrement, g.interpolation, d0, numSamples);
+    }
+    template <typename SampleType, SampleStorage Storage>
+    static ReadFn<SampleType> selectReader(bool reverse, bool unity){
+        if (reverse) return unity ? &readKernel<SampleType, Storage, true, true> : &readKernel<SampleType, Storage, true, false>;
+        return unity ? &readKernel<SampleType, Storage, false, true> : &readKernel<SampleType, Storage, false, false>;
+    }
+    template <typename SampleType>
+    static ReadFn<SampleType> selectReader(SampleStorage storage, bool reverse, bool unity){
+        switch (storage){
+            case SampleStorage::interleavedInt16: return selectReader<SampleType, SampleStorage::interleavedInt16>(reverse, unity);
+            case SampleStorage::interleavedHalf: return selectReader<SampleType, SampleStorage::interleavedHalf>(reverse, unity);
+            default: return selectReader<SampleType, SampleStorage::planarFloat>(reverse, unity);
+        }
+    }
+
+    template <typename SampleType>
+    static RenderFn<SampleType> selectKernel(SampleStorage storage, bool reverse, bool curved, bool unity, int src, int dst){
+        switch (storage){
+            case SampleStorage::interleavedInt16: return selectDirection<SampleType, SampleStorage::interleavedInt16>(reverse, curved, unity, src, dst);
+            case SampleStorage::interleavedHalf: return selectDirection<SampleType, SampleStorage::interleavedHalf>(reverse, curved, unity, src, dst);
+            default: return selectDirection<SampleType, SampleStorage::planarFloat>(reverse, curved, unity, src, dst);
+        }
+    }
+};
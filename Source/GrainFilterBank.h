@@ -0,0 +1,165 @@
+/*
+  ==============================================================================
+
+    GrainFilterBank.h
+    Runs the resonant filters of many grains side by side.
+
+  ==============================================================================
+*/
+
+#pragma once
+
+#include <JuceHeader.h>
+#include "GrainPool.h"
+
+//==============================================================================
+/**
+    Renders a GrainPool, filtering the grains that have a GrainFilter.
+
+    A filter is a recursion, so one grain's samples cannot be worked out in
+    parallel. Different grains can be: every source channel of a filtered grain
+    becomes a lane, and `lanes` of them run through the same loop with their
+    samples interleaved. The loop body is the same for every lane, so the
+    compiler turns it into one SIMD instruction per step. The lanes run in the
+    block's own sample type, so the double path is filtered in double; the
+    state is kept in double either way.
+
+    The filter runs on the raw source before the envelope, so the grain fades
+    in and out of its own resonance instead of ringing past its end. State is
+    kept per pool slot and cleared on the grain's first sample, so a grain
+    sounds the same whatever the block size.
+*/
+class GrainFilterBank
+{
+public:
+    static constexpr int lanes = 4;
+    static constexpr int maxSources = 8;   //source channels filtered per grain, the rest stay silent
+
+    GrainFilterBank() : state(new double[GrainPool::capacity * maxSources * 2]()) {}
+
+    // adds every grain in the pool that sounds in [blockStart, blockStart + block.getNumSamples()) into block
+    template <typename SampleType>
+    void render(const GrainPool& pool, juce::AudioBuffer<SampleType>& block, const ReferenceCountedBuffer& file, long long int blockStart)
+    {
+        const int numSamples = block.getNumSamples();
+        int numLanes = 0;
+        for (int i = 0; i < pool.size(); i++){
+            const Grain& g = pool[i];
+            if (!g.filter.active){
+                g.render(block, file, blockStart);
+                continue;
+            }
+            Lane lane;
+            if (file.getNumSamples() < 2 || !g.window(blockStart, numSamples, lane.offset, lane.d0, lane.count)) continue;
+            const int numSources = juce::jmin(maxSources, g.numSources(file, block.getNumChannels()));
+            for (int s = 0; s < numSources; s++){
+                lane.grain = &g;
+                lane.source = s;
+                lane.state = state.get() + (pool.slotOf(i) * maxSources + s) * 2;
+                if (lane.d0 == g.firstSample()) lane.state[0] = lane.state[1] = 0;
+                group[numLanes++] = lane;
+                if (numLanes == lanes){
+                    renderGroup(block, file, numLanes);
+                    numLanes = 0;
+                }
+            }
+        }
+        if (numLanes > 0) renderGroup(block, file, numLanes);
+    }
+
+    // goes with GrainPool::swap, the state is kept per slot
+    void swap(GrainFilterBank& other) {std::swap(state, other.state);}
+
+private:
+    static constexpr int chunkSize = 256;
+
+    struct Lane
+    {
+        const Grain* grain = nullptr;
+        int source = 0;
+        int offset = 0, d0 = 0, count = 0; //block offset, samples from onset, length
+        double* state = nullptr;
+    };
+
+    template <typename SampleType>
+    void renderGroup(juce::AudioBuffer<SampleType>& block, const ReferenceCountedBuffer& file, int numLanes)
+    {
+        //unused lanes get zero coefficients and zero input, so they stay silent
+        SampleType ic1[lanes] = {}, ic2[lanes] = {};
+        SampleType a1[lanes] = {}, a2[lanes] = {}, a3[lanes] = {};
+        SampleType m0[lanes] = {}, m1[lanes] = {}, m2[lanes] = {};
+        SampleType* x = getTemp<SampleType>(2);
+        int from = block.getNumSamples(), to = 0;
+        for (int l = 0; l < numLanes; l++){
+            const Lane& lane = group[l];
+            const GrainFilter& f = lane.grain->filter;
+            ic1[l] = (SampleType) lane.state[0];
+            ic2[l] = (SampleType) lane.state[1];
+            a1[l] = (SampleType) f.a1; a2[l] = (SampleType) f.a2; a3[l] = (SampleType) f.a3;
+            m0[l] = (SampleType) f.m0; m1[l] = (SampleType) f.m1; m2[l] = (SampleType) f.m2;
+            from = juce::jmin(from, lane.offset);
+            to = juce::jmax(to, lane.offset + lane.count);
+        }
+
+        for (int start = from; start < to; start += chunkSize){
+            const int n = juce::jmin(chunkSize, to - start);
+
+            //gather: a lane is zero outside its grain, where its state is either still clear or no longer needed
+            juce::FloatVectorOperations::clear(x, n * lanes);
+            for (int l = 0; l < numLanes; l++){
+                const Lane& lane = group[l];
+                const int a = juce::jmax(start, lane.offset), b = juce::jmin(start + n, lane.offset + lane.count);
+                if (a >= b) continue;
+                SampleType* raw = getTemp<SampleType>(0);
+                lane.grain->readRaw(file, lane.source, raw, lane.d0 + a - lane.offset, b - a);
+                for (int i = 0; i < b - a; i++) x[(a - start + i) * lanes + l] = raw[i];
+            }
+
+            //trapezoidal state-variable filter, one sample of every lane per step
+            for (int i = 0; i < n; i++){
+                SampleType* v = x + i * lanes;
+                for (int l = 0; l < lanes; l++){
+                    const SampleType v0 = v[l];
+                    const SampleType v3 = v0 - ic2[l];
+                    const SampleType v1 = a1[l] * ic1[l] + a2[l] * v3;
+                    const SampleType v2 = ic2[l] + a2[l] * ic1[l] + a3[l] * v3;
+                    ic1[l] = 2 * v1 - ic1[l];
+                    ic2[l] = 2 * v2 - ic2[l];
+                    v[l] = m0[l] * v0 + m1[l] * v1 + m2[l] * v2;
+                }
+            }
+
+            //scatter: envelope and route each lane like an unfiltered grain
+            for (int l = 0; l < numLanes; l++){
+                const Lane& lane = group[l];
+                const int a = juce::jmax(start, lane.offset), b = juce::jmin(start + n, lane.offset + lane.count);
+                if (a >= b) continue;
+                SampleType* out = getTemp<SampleType>(0);
+                SampleType* gain = getTemp<SampleType>(1);
+                for (int i = 0; i < b - a; i++) out[i] = x[(a - start + i) * lanes + l];
+                lane.grain->fillGain(gain, lane.d0 + a - lane.offset, b - a);
+                juce::FloatVectorOperations::multiply(out, gain, b - a);
+                lane.grain->addSource(block, a, lane.source, file.getNumChannels(), out, b - a);
+            }
+        }
+
+        for (int l = 0; l < numLanes; l++){
+            group[l].state[0] = ic1[l];
+            group[l].state[1] = ic2[l];
+        }
+    }
+
+    template <typename SampleType>
+    SampleType* getTemp(int index){
+        if constexpr (std::is_same_v<SampleType, double>) return tempDouble[index];
+        else return tempFloat[index];
+    }
+
+    std::unique_ptr<double[]> state;   //integrator pair per pool slot and source channel
+    Lane group[lanes];
+    //two scratch runs of one lane, then every lane's samples interleaved
+    float tempFloat[3][chunkSize * lanes];
+    double tempDouble[3][chunkSize * lanes];
+
+    JUCE_DECLARE_NON_COPYABLE (GrainFilterBank)
+};
@@ -0,0 +1,85 @@
+/*
+  ==============================================================================
+
+    GrainPool.h
+    Fixed set of grain slots that every voice spawns into.
+
+  ==============================================================================
+*/
+
+#pragma once
+
+#include <JuceHeader.h>
+#include "Grain.h"
+
+//==============================================================================
+/**
+    All slots are allocated up front, so the audio thread can spawn and retire
+    grains with no allocation and no lock. Grains are built in place because
+    their fields are const. The live ones are kept as a dense index list, so
+    rendering and retiring only ever touch the grains that are sounding.
+*/
+class GrainPool
+{
+public:
+    static constexpr int capacity = 4096;
+
+    GrainPool() : slots(new std::optional<Grain>[capacity])
+    {
+        for (int i = 0; i < capacity; i++) freeSlots[i] = capacity - 1 - i;
+        numFree = capacity;
+    }
+
+    // builds a grain in a free slot, false (and no grain) when the pool is full or the grain is culled
+    template <typename... Args>
+    bool spawn(Args&&... args)
+    {
+        if (numFree == 0) return false;
+        const int slot = freeSlots[numFree - 1];
+        slots[slot].emplace(std::forward<Args>(args)...);
+        if (slots[slot]->isCulled()){
+            slots[slot].reset();
+            return false;
+        }
+        numFree--;
+        active[numActive++] = slot;
+        return true;
+    }
+
+    int size() const {return numActive;}
+    const Grain& operator[] (int index) const {return *slots[active[index]];}
+    // the slot behind a live grain, stays the same for the grain's whole life
+    int slotOf(int index) const {return active[index];}
+
+    // frees every grain that has nothing left to play at or after `time`
+    void retireFinished(long long int time)
+    {
+        for (int i = numActive - 1; i >= 0; i--){
+            const int slot = active[i];
+            if (slots[slot]->end() > time) continue;
+            slots[slot].reset();
+            freeSlots[numFree++] = slot;
+            active[i] = active[--numActive];
+        }
+    }
+
+    void clear() {retireFinished(std::numeric_limits<long long int>::max());}
+
+    // trades every grain with another pool, slots included, so grains keep their filter state
+    void swap(GrainPool& other)
+    {
+        std::swap(slots, other.slots);
+        std::swap(active, other.active);
+        std::swap(freeSlots, other.freeSlots);
+        std::swap(numActive, other.numActive);
+        std::swap(numFree, other.numFree);
+    }
+
+private:
+    std::unique_ptr<std::optional<Grain>[]> slots;
+    int active[capacity];
+    int freeSlots[capacity];
+    int numActive = 0, numFree = 0;
+
+    JUCE_DECLARE_NON_COPYABLE (GrainPool)
+};
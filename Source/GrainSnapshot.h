@@ -0,0 +1,63 @@
+/*
+  ==============================================================================
+
+    GrainSnapshot.h
+    Lock-free hand-over of the active grains from the audio thread to the editor.
+
+  ==============================================================================
+*/
+
+#pragma once
+
+#include <JuceHeader.h>
+
+//==============================================================================
+/**
+    Single writer, single reader triple buffer. The writer fills its back
+    buffer and swaps it with the middle one. The reader swaps the middle buffer
+    into the front only if something new was published. Neither side waits or
+    copies, and each side always has a buffer to itself.
+*/
+template <typename Type>
+class TripleBuffer
+{
+public:
+    // writer side
+    Type& getWriteBuffer() {return buffers[back];}
+    void publish() {back = middle.exchange(back | newDataFlag) & indexMask;}
+
+    // reader side: true if a newer buffer was picked up
+    bool update(){
+        if ((middle.load() & newDataFlag) == 0) return false;
+        front = middle.exchange(front) & indexMask;
+        return true;
+    }
+    const Type& getReadBuffer() const {return buffers[front];}
+
+private:
+    static constexpr int indexMask = 3;
+    static constexpr int newDataFlag = 4;
+    Type buffers[3];
+    int back = 0, front = 2;
+    std::atomic<int> middle {1};
+};
+
+//==============================================================================
+/**
+    What the editor needs to draw one grain, in fractions of the file length.
+    Written once per block by the audio thread, only for grains that are sounding.
+*/
+struct GrainSnapshot
+{
+    struct Entry
+    {
+        float start; //where the grain began reading
+        float span;  //how much of the file it covers, negative when it plays backwards
+        float head;  //where it reads now
+        float gain;  //amp times an uncurved envelope, close enough to draw with
+    };
+
+    static constexpr int capacity = 4096;
+    Entry entries[capacity];
+    int numEntries = 0;
+};
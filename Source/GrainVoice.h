@@ -0,0 +1,124 @@
+/*
+  ==============================================================================
+
+    GrainVoice.h
+    One held note and the grain stream it schedules.
+
+  ==============================================================================
+*/
+
+#pragma once
+
+#include <JuceHeader.h>
+
+//==============================================================================
+// Every parameter a grain is built from, read once per block on the audio thread.
+struct GrainParams
+{
+    float position = 0.5f, randPos = 0;
+    float duration = 0.7f, randDur = 0;
+    float volume = 0.7f, randGain = 0;
+    float density = 0.4f, randDens = 0;
+    bool reverse = false;
+    float randRev = 0;
+    float randPitch = 0;
+    float transpose = 0;  //semitones, fractional once modulated
+    float envAttack = 0.3f, envRelease = 0.3f, envCurve = 0;
+    float cullThreshold = 0;
+    float pan = 0, spread = 0, width = 1;
+    int filterMode = 0;   //GrainFilter::Mode
+    float cutoff = 1000.0f, resonance = 0.707f, randCutoff = 0;
+    bool spectral = false;
+    int placement = 0;    //SourceIndex::Placement
+    bool pitchSync = false;
+    int interpolation = 0;    //CircularRead::Interpolation
+    bool live = false;
+    float tail = 0.5f;
+
+    bool operator== (const GrainParams& o) const{
+        return std::tie(position, randPos, duration, randDur, volume, randGain, density, randDens, reverse, randRev, randPitch,
+                        transpose, envAttack, envRelease, envCurve, cullThreshold, pan, spread, width,
+                        filterMode, cutoff, resonance, randCutoff, spectral, placement, pitchSync, interpolation, live, tail)
+            == std::tie(o.position, o.randPos, o.duration, o.randDur, o.volume, o.randGain, o.density, o.randDens, o.reverse, o.randRev, o.randPitch,
+                        o.transpose, o.envAttack, o.envRelease, o.envCurve, o.cullThreshold, o.pan, o.spread, o.width,
+                        o.filterMode, o.cutoff, o.resonance, o.randCutoff, o.spectral, o.placement, o.pitchSync, o.interpolation, o.live, o.tail);
+    }
+};
+
+//==============================================================================
+/**
+    Each voice has its own density clock, so a chord of n notes schedules n
+    independent streams instead of one stream shared between them. A held voice
+    follows the parameters block by block. Once released it keeps the last
+    snapshot and goes on spawning grains, quieter and quieter, for the length
+    of the tail. The grains it has already spawned play out in the pool either
+    way.
+*/
+class GrainVoice
+{
+public:
+    enum class State {free, held, releasing};
+    static constexpr int maxVoices = 32;
+
+    State state = State::free;
+    int note = -1;
+    float velocity = 0;      //0 to 1
+    long long int startedAt = 0;
+    long long int nextOnset = 0;
+    GrainParams params;
+    // the voice's own random stream, reseeded at every note and by prepareToPlay
+    juce::Random random;
+
+    void start(int newNote, float newVelocity, long long int onset, juce::int64 seed){
+        state = State::held;
+        note = newNote;
+        velocity = newVelocity;
+        startedAt = onset;
+        nextOnset = onset;
+        random.setSeed(seed);
+    }
+
+    void release(long long int when, int tailSamples){
+        if (state != State::held) return;
+        releaseStart = when;
+        releaseLength = tailSamples;
+        state = tailSamples > 0 ? State::releasing : State::free;
+    }
+
+    // gain of grains spawned at time t, ramps to 0 over the tail
+    float level(long long int t) const{
+        if (state != State::releasing) return state == State::held ? 1.0f : 0.0f;
+        return juce::jlimit(0.0f, 1.0f, 1.0f - (float) (t - releaseStart) / (float) releaseLength);
+    }
+
+    // frees a released voice once its tail has run out before `time`
+    void updateState(long long int time){
+        if (state == State::releasing && time >= releaseStart + releaseLength) state = State::free;
+    }
+
+    /** The voice a new note should use: the one already playing this note,
+        then a free one, then the released voice furthest into its tail, then
+        the oldest held one.
+    */
+    static GrainVoice& allocate(GrainVoice* voices, int numVoices, int newNote){
+        GrainVoice* best = nullptr;
+        auto rank = [newNote](const GrainVoice& v){
+            if (v.note == newNote && v.state != State::free) return 0;
+            if (v.state == State::free) return 1;
+            return v.state == State::releasing ? 2 : 3;
+        };
+        for (int i = 0; i < numVoices; i++){
+            GrainVoice& v = voices[i];
+            if (best == nullptr || rank(v) < rank(*best)) best = &v;
+            else if (rank(v) == rank(*best) && rank(v) >= 2 && v.stealOrder() < best->stealOrder()) best = &v;
+        }
+        return *best;
+    }
+
+private:
+    long long int releaseStart = 0;
+    int releaseLength = 0;
+
+    // releasing voices go by how long ago they were let go, held ones by when they started
+    long long int stealOrder() const {return state == State::releasing ? releaseStart : startedAt;}
+};
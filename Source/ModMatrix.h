@@ -0,0 +1,199 @@
+/*
+  ==============================================================================
+
+    ModMatrix.h
+    LFOs, a random source and a per-note envelope routed onto grain parameters.
+
+  ==============================================================================
+*/
+
+#pragma once
+
+#include <JuceHeader.h>
+#include "GrainVoice.h"
+
+//==============================================================================
+/**
+    Sources are worked out at control rate and only read when a grain spawns,
+    so modulation costs nothing per sample.
+
+    - The LFOs and the random source are filled once per block, one value per
+      controlInterval samples. Their grid is aligned to engine time, so the
+      block size does not change what a grain sees. The phase at any grid
+      point comes straight from the point's index, so skipped (idle) blocks
+      need no catching up.
+    - The note envelope and velocity belong to a voice. They are worked out
+      from the voice when its grain spawns.
+
+    Each slot adds depth * source to one destination in the parameter's
+    normalised 0..1 range, so one depth means the same amount of travel on a
+    skewed knob as on a linear one.
+*/
+class ModMatrix
+{
+public:
+    enum Source {off, lfo1, lfo2, random, noteEnvelope, velocity, numSources};
+    enum Shape {sine, triangle, saw, square};
+    static constexpr int numSlots = 4;
+    static constexpr int numLfos = 2;
+    static constexpr int controlInterval = 32;
+    static constexpr int maxPoints = 512;   //a block longer than maxPoints * controlInterval holds its last value
+    static constexpr int maxDestinations = 24;
+
+    // everything the host can change, read once per block
+    struct Settings
+    {
+        struct Lfo
+        {
+            float rate = 1.0f;  //Hz
+            int shape = sine;
+        };
+        struct Slot
+        {
+            int source = off;
+            int destination = 0; //0 is off, n is the n-th destination added
+            float depth = 0;
+        };
+        Lfo lfo[numLfos];
+        float randomRate = 4.0f;
+        float envAttack = 0.5f, envDecay = 0.5f, envSustain = 0.5f; //seconds, seconds, level
+        Slot slot[numSlots];
+
+        bool operator== (const Settings& o) const{
+            for (int l = 0; l < numLfos; l++)
+                if (lfo[l].rate != o.lfo[l].rate || lfo[l].shape != o.lfo[l].shape) return false;
+            for (int s = 0; s < numSlots; s++)
+                if (slot[s].source != o.slot[s].source || slot[s].destination != o.slot[s].destination || slot[s].depth != o.slot[s].depth) return false;
+            return randomRate == o.randomRate && envAttack == o.envAttack && envDecay == o.envDecay && envSustain == o.envSustain;
+        }
+    };
+
+    static juce::StringArray getSourceNames() {return {"off", "lfo 1", "lfo 2", "random", "envelope", "velocity"};}
+    static juce::StringArray getShapeNames() {return {"sine", "triangle", "saw", "square"};}
+
+    // a grain parameter that can be modulated, the range is the host parameter's and has to outlive the matrix
+    void addDestination(const juce::String& name, const juce::RangedAudioParameter& param, float GrainParams::* field){
+        jassert(numDestinations < maxDestinations);
+        destinations[numDestinations++] = {&param.getNormalisableRange(), field};
+        destinationNames.add(name);
+    }
+    juce::StringArray getDestinationNames() const{
+        juce::StringArray names;
+        names.add("off");
+        for (const juce::String& n : destinationNames) names.add(n);
+        return names;
+    }
+
+    void prepare(double newSampleRate) {sampleRate = newSampleRate;}
+
+    // fills the control points covering [blockStart, blockStart + numSamples)
+    void process(long long int blockStart, int numSamples, const Settings& newSettings){
+        settings = newSettings;
+        active = false;
+        for (const Settings::Slot& s : settings.slot)
+            if (s.source != off && s.destination > 0 && s.destination <= numDestinations && s.depth != 0) active = true;
+        if (!active) return;
+
+        firstPoint = blockStart / controlInterval;
+        const long long int lastPoint = (blockStart + juce::jmax(1, numSamples) - 1) / controlInterval;
+        numPoints = (int) juce::jmin((long long int) maxPoints, lastPoint - firstPoint + 1);
+
+        for (int l = 0; l < numLfos; l++){
+            phasors[l].setRate(settings.lfo[l].rate, sampleRate, firstPoint);
+            phasors[l].fill(phase, firstPoint, numPoints);
+            fillShape(values[l], phase, numPoints, settings.lfo[l].shape);
+        }
+        phasors[numLfos].setRate(settings.randomRate, sampleRate, firstPoint);
+        phasors[numLfos].fill(phase, firstPoint, numPoints);
+        for (int i = 0; i < numPoints; i++) values[numLfos][i] = hashToBipolar((juce::int64) std::floor(phase[i]));
+    }
+
+    // adds every routed source to p as it stands at time t for this voice
+    void apply(GrainParams& p, long long int t, const GrainVoice& voice) const{
+        if (!active) return;
+        for (const Settings::Slot& s : settings.slot){
+            if (s.source == off || s.destination <= 0 || s.destination > numDestinations || s.depth == 0) continue;
+            const Destination& d = destinations[s.destination - 1];
+            const float normalised = d.range->convertTo0to1(p.*(d.field)) + s.depth * sourceValue(s.source, t, voice);
+            p.*(d.field) = d.range->convertFrom0to1(juce::jlimit(0.0f, 1.0f, normalised));
+        }
+    }
+
+private:
+    struct Destination
+    {
+        const juce::NormalisableRange<float>* range;
+        float GrainParams::* field;
+    };
+
+    // unwrapped phase as a function of the control point index, continuous across rate changes
+    struct Phasor
+    {
+        double offset = 0, increment = 0;
+        void setRate(float rate, double fs, long long int point){
+            const double newIncrement = fs > 0 ? rate * controlInterval / fs : 0;
+            if (newIncrement == increment) return;
+            offset = std::fmod(offset + (double) point * (increment - newIncrement), 1.0e6);
+            increment = newIncrement;
+        }
+        void fill(double* dest, long long int point, int n) const{
+            for (int i = 0; i < n; i++) dest[i] = offset + (double) (point + i) * increment;
+        }
+    };
+
+    float sourceValue(int source, long long int t, const GrainVoice& voice) const{
+        switch (source){
+            case lfo1: case lfo2: case random:{
+                const int index = (int) juce::jlimit((long long int) 0, (long long int) numPoints - 1, t / controlInterval - firstPoint);
+                return values[source - lfo1][index];
+            }
+            case noteEnvelope: return envelopeAt(t, voice);
+            case velocity: return voice.velocity;
+            default: return 0;
+        }
+    }
+
+    // attack to 1, decay to sustain, then down with the voice's release tail
+    float envelopeAt(long long int t, const GrainVoice& voice) const{
+        const float elapsed = (float) ((double) (t - voice.startedAt) / sampleRate);
+        float e;
+        if (elapsed < settings.envAttack) e = elapsed / settings.envAttack;
+        else if (elapsed < settings.envAttack + settings.envDecay) e = 1.0f - (1.0f - settings.envSustain) * (elapsed - settings.envAttack) / settings.envDecay;
+        else e = settings.envSustain;
+        return e * voice.level(t);
+    }
+
+    static void fillShape(float* dest, const double* phase, int n, int shape){
+        for (int i = 0; i < n; i++){
+            const float x = (float) (phase[i] - std::floor(phase[i]));
+            switch (shape){
+                case triangle: dest[i] = 1.0f - 4.0f * std::abs(x - 0.5f); break;
+                case saw: dest[i] = 2.0f * x - 1.0f; break;
+                case square: dest[i] = x < 0.5f ? 1.0f : -1.0f; break;
+                default: dest[i] = std::sin(juce::MathConstants<float>::twoPi * x); break;
+            }
+        }
+    }
+
+    // the same step always gets the same value, whatever the block size
+    static float hashToBipolar(juce::int64 step){
+        juce::uint64 h = (juce::uint64) step * 0x9E3779B97F4A7C15ull;
+        h ^= h >> 31;
+        h *= 0xBF58476D1CE4E5B9ull;
+        h ^= h >> 29;
+        return (float) (h >> 40) / (float) (1 << 23) - 1.0f;
+    }
+
+    Destination destinations[maxDestinations];
+    int numDestinations = 0;
+    juce::StringArray destinationNames;
+    double sampleRate = 44100.0;
+    Settings settings;
+    bool active = false;
+
+    Phasor phasors[numLfos + 1];
+    long long int firstPoint = 0;
+    int numPoints = 0;
+    double phase[maxPoints];
+    float values[numLfos + 1][maxPoints];
+};
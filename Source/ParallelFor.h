@@ -0,0 +1,38 @@
+/*
+  ==============================================================================
+
+    ParallelFor.h
+    Splits a background analysis over every thread of a pool.
+
+  ==============================================================================
+*/
+
+#pragma once
+
+#include <JuceHeader.h>
+
+//==============================================================================
+/** Calls fn(first, last) on consecutive ranges covering [0, numItems), one
+    range per thread of pool, and waits until all of them are done. Returns
+    false as soon as `cancelled` turns true. The jobs still running then finish
+    on their own, so fn has to own (or keep alive) everything it touches.
+*/
+inline bool parallelFor(juce::ThreadPool& pool, int numItems, const std::function<void(int, int)>& fn, const std::function<bool()>& cancelled)
+{
+    if (numItems <= 0) return true;
+    const int numJobs = juce::jlimit(1, numItems, pool.getNumThreads());
+    auto remaining = std::make_shared<std::atomic<int>> (numJobs);
+    auto finished = std::make_shared<juce::WaitableEvent>();
+    for (int j = 0; j < numJobs; j++){
+        const int first = (int) ((juce::int64) numItems * j / numJobs);
+        const int last = (int) ((juce::int64) numItems * (j + 1) / numJobs);
+        pool.addJob([fn, first, last, remaining, finished]{
+            fn(first, last);
+            if (--(*remaining) == 0) finished->signal();
+        });
+    }
+    while (! finished->wait(50)){
+        if (cancelled()) return false;
+    }
+    return true;
+}
@@ -0,0 +1,68 @@
+/*
+  ==============================================================================
+
+    ParameterRefresh.h
+    One timer that updates every parameter widget whose value has changed.
+
+  ==============================================================================
+*/
+
+#pragma once
+
+#include <JuceHeader.h>
+
+//==============================================================================
+/**
+    Widgets used to poll their parameter from their own 60 Hz timer. Now each
+    widget is a Client that listens to its parameter and marks itself dirty.
+    There is a single driver, shared by all open editors, with one timer. On
+    each tick it checks a generation counter and only visits the clients if
+    that counter has moved, so an idle editor costs one atomic load per frame.
+*/
+class ParameterRefreshDriver : private juce::Timer
+{
+public:
+    class Client : private juce::AudioProcessorParameter::Listener
+    {
+    public:
+        explicit Client(juce::AudioProcessorParameter& p) : watched(p){
+            driver->clients.add(this);
+            watched.addListener(this);
+        }
+        ~Client() override{
+            watched.removeListener(this);
+            driver->clients.removeFirstMatchingValue(this);
+        }
+        // called on the message thread, only after the parameter has changed
+        virtual void refresh() = 0;
+
+    private:
+        friend class ParameterRefreshDriver;
+        // may come from the audio thread or the host, so only flag it here
+        void parameterValueChanged(int, float) override{
+            dirty = true;
+            driver->generation++;
+        }
+        void parameterGestureChanged(int, bool) override {}
+
+        juce::AudioProcessorParameter& watched;
+        juce::SharedResourcePointer<ParameterRefreshDriver> driver;
+        std::atomic<bool> dirty {false};
+    };
+
+    ParameterRefreshDriver() {startTimerHz(60);}
+    ~ParameterRefreshDriver() override {stopTimer();}
+
+private:
+    void timerCallback() override{
+        const juce::uint32 current = generation.load();
+        if (current == lastGeneration) return;
+        lastGeneration = current;
+        for (auto* client : clients)
+            if (client->dirty.exchange(false)) client->refresh();
+    }
+
+    std::atomic<juce::uint32> generation {0};
+    juce::uint32 lastGeneration = 0;
+    juce::Array<Client*> clients; //message thread only
+};
@@ -0,0 +1,151 @@
+/*
+  ==============================================================================
+
+    PeakPyramid.h
+    Min/max overview of the loaded file at several resolutions.
+
+  ==============================================================================
+*/
+
+#pragma once
+
+#include <JuceHeader.h>
+#include "ReferenceCountedBuffer.h"
+
+//==============================================================================
+/**
+    Level 0 keeps the min and max of every baseBinSize samples. Each level above
+    it merges levelRatio bins of the one below, up to a single bin for the whole
+    file. It is built from the processor's decoded buffer, so the editor never
+    has to decode the file again. When drawing, it uses the coarsest level that
+    still has at least one bin per pixel.
+
+    Built once on a background thread, immutable afterwards and shared by
+    reference, so the editor can paint from it without locking.
+*/
+class PeakPyramid : public juce::ReferenceCountedObject
+{
+public:
+    typedef juce::ReferenceCountedObjectPtr<PeakPyramid> Ptr;
+    static constexpr int baseBinSize = 256;
+    static constexpr int levelRatio = 4;
+
+    struct Peak
+    {
+        float min = 0, max = 0;
+        void merge(const Peak& o) {min = juce::jmin(min, o.min); max = juce::jmax(max, o.max);}
+    };
+
+    explicit PeakPyramid(const ReferenceCountedBuffer& file):
+    numChannels(file.getNumChannels()), numSamples(file.getNumSamples())
+    {
+        switch (file.getStorage()){
+            case SampleStorage::interleavedInt16: buildBase<SampleStorage::interleavedInt16>(file); break;
+            case SampleStorage::interleavedHalf: buildBase<SampleStorage::interleavedHalf>(file); break;
+            default: buildBase<SampleStorage::planarFloat>(file); break;
+        }
+        while (levels.getReference(levels.size() - 1).numBins > 1) buildNextLevel();
+    }
+
+    int getNumChannels() const {return numChannels;}
+    int getNumSamples() const {return numSamples;}
+
+    // draws [startSample, endSample) of every channel stacked inside bounds, one vertical line per pixel
+    void drawChannels(juce::Graphics& g, const juce::Rectangle<int>& bounds, juce::int64 startSample, juce::int64 endSample, float verticalZoom) const
+    {
+        const int width = bounds.getWidth();
+        if (numChannels == 0 || width <= 0 || endSample <= startSample) return;
+        const double samplesPerPixel = (double) (endSample - startSample) / width;
+        const Level& level = levelFor(samplesPerPixel);
+        const int channelHeight = bounds.getHeight() / numChannels;
+
+        for (int c = 0; c < numChannels; c++){
+            const Peak* peaks = level.peaks.begin() + (size_t) c * (size_t) level.numBins;
+            const float centre = (float) bounds.getY() + channelHeight * (c + 0.5f);
+            const float halfHeight = channelHeight * 0.5f * verticalZoom;
+            for (int x = 0; x < width; x++){
+                const juce::int64 s0 = startSample + (juce::int64) (samplesPerPixel * x);
+                const juce::int64 s1 = juce::jmax(s0 + 1, startSample + (juce::int64) (samplesPerPixel * (x + 1)));
+                const int b0 = (int) juce::jlimit((juce::int64) 0, (juce::int64) level.numBins - 1, s0 / level.binSize);
+                const int b1 = (int) juce::jlimit((juce::int64) b0 + 1, (juce::int64) level.numBins, (s1 + level.binSize - 1) / level.binSize);
+                Peak p = peaks[b0];
+                for (int b = b0 + 1; b < b1; b++) p.merge(peaks[b]);
+                const float top = centre - juce::jlimit(-1.0f, 1.0f, p.max) * halfHeight;
+                const float bottom = centre - juce::jlimit(-1.0f, 1.0f, p.min) * halfHeight;
+                g.drawVerticalLine(bounds.getX() + x, top, juce::jmax(bottom, top + 1.0f));
+            }
+        }
+    }
+
+private:
+    struct Level
+    {
+        juce::int64 binSize = baseBinSize;
+        int numBins = 0;
+        juce::Array<Peak> peaks; //channel-major, numBins per channel
+    };
+
+    template <SampleStorage Storage>
+    void buildBase(const ReferenceCountedBuffer& file)
+    {
+        Level base;
+        base.numBins = juce::jmax(1, (numSamples + baseBinSize - 1) / baseBinSize);
+        base.peaks.resize(numChannels * base.numBins);
+        for (int c = 0; c < numChannels; c++){
+            const auto reader = file.getReader<float, Storage>(c);
+            Peak* out = base.peaks.getRawDataPointer() + (size_t) c * (size_t) base.numBins;
+            for (int b = 0; b < base.numBins; b++){
+                const int s0 = b * baseBinSize;
+                const int s1 = juce::jmin(numSamples, s0 + baseBinSize);
+                Peak p;
+                if constexpr (Storage == SampleStorage::planarFloat){
+                    if (s1 > s0){
+                        const auto range = juce::FloatVectorOperations::findMinAndMax(reader.data + s0, s1 - s0);
+                        p = {range.getStart(), range.getEnd()};
+                    }
+                }else{
+                    if (s1 > s0) p.min = p.max = reader[s0];
+                    for (int i = s0 + 1; i < s1; i++){
+                        const float v = reader[i];
+                        p.min = juce::jmin(p.min, v);
+                        p.max = juce::jmax(p.max, v);
+                    }
+                }
+                out[b] = p;
+            }
+        }
+        levels.add(std::move(base));
+    }
+
+    void buildNextLevel()
+    {
+        const Level& below = levels.getReference(levels.size() - 1);
+        Level next;
+        next.binSize = below.binSize * levelRatio;
+        next.numBins = (below.numBins + levelRatio - 1) / levelRatio;
+        next.peaks.resize(numChannels * next.numBins);
+        for (int c = 0; c < numChannels; c++){
+            const Peak* in = below.peaks.begin() + (size_t) c * (size_t) below.numBins;
+            Peak* out = next.peaks.getRawDataPointer() + (size_t) c * (size_t) next.numBins;
+            for (int b = 0; b < next.numBins; b++){
+                const int b0 = b * levelRatio;
+                const int b1 = juce::jmin(below.numBins, b0 + levelRatio);
+                Peak p = in[b0];
+                for (int i = b0 + 1; i < b1; i++) p.merge(in[i]);
+                out[b] = p;
+            }
+        }
+        levels.add(std::move(next));
+    }
+
+    const Level& levelFor(double samplesPerPixel) const
+    {
+        int l = 0;
+        while (l + 1 < levels.size() && (double) levels.getReference(l + 1).binSize <= samplesPerPixel) l++;
+        return levels.getReference(l);
+    }
+
+    const int numChannels;
+    const int numSamples;
+    juce::Array<Level> levels;
+};
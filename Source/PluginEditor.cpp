@@ -11,9 +11,8 @@
 
 //==============================================================================
 CranulatorAudioProcessorEditor::CranulatorAudioProcessorEditor (CranulatorAudioProcessor& p)
-    : AudioProcessorEditor (&p), audioProcessor (p),thumbnailCache(5),
-thumbnail(512, formatManager, thumbnailCache),
-midiKeyboard(p.keyboardState, juce::MidiKeyboardComponent::horizontalKeyboard)
+    : AudioProcessorEditor (&p), audioProcessor (p),
+midiKeyboard(p.keyboardState, juce::MidiKeyboardComponent::horizontalKeyboard), browser(p)
 {
     // Make sure that before the constructor has finished, you've set the
     // editor's size to whatever you need it to be.
@@ -92,6 +91,33 @@ midiKeyboard(p.keyboardState, juce::MidiKeyboardComponent::horizontalKeyboard)
     reverseButton->setColour(juce::TextButton::textColourOffId, juce::Colours::darkgrey);
     reverseButton->onClick = [this] { buttonClicked(reverseButton); };
     
+    addAndMakeVisible(liveButton = new ParameterButton(*p.liveInput));
+    liveButton->setButtonText("live");
+    liveButton->setClickingTogglesState(true);
+    liveButton->setColour(juce::TextButton::buttonColourId, getLookAndFeel().findColour (juce::ResizableWindow::backgroundColourId));
+    liveButton->setColour(juce::TextButton::textColourOnId, juce::Colours::white);
+    liveButton->setColour(juce::TextButton::textColourOffId, juce::Colours::darkgrey);
+    
+    addAndMakeVisible(freezeButton = new ParameterButton(*p.freeze));
+    freezeButton->setButtonText("freeze");
+    freezeButton->setClickingTogglesState(true);
+    freezeButton->setColour(juce::TextButton::buttonColourId, getLookAndFeel().findColour (juce::ResizableWindow::backgroundColourId));
+    freezeButton->setColour(juce::TextButton::textColourOnId, juce::Colours::white);
+    freezeButton->setColour(juce::TextButton::textColourOffId, juce::Colours::darkgrey);
+    
+    addAndMakeVisible(spectralButton = new ParameterButton(*p.spectral));
+    spectralButton->setButtonText("spectral");
+    spectralButton->setClickingTogglesState(true);
+    spectralButton->setColour(juce::TextButton::buttonColourId, getLookAndFeel().findColour (juce::ResizableWindow::backgroundColourId));
+    spectralButton->setColour(juce::TextButton::textColourOnId, juce::Colours::white);
+    spectralButton->setColour(juce::TextButton::textColourOffId, juce::Colours::darkgrey);
+    addAndMakeVisible(pitchSyncButton = new ParameterButton(*p.pitchSync));
+    pitchSyncButton->setButtonText("psync");
+    pitchSyncButton->setClickingTogglesState(true);
+    pitchSyncButton->setColour(juce::TextButton::buttonColourId, getLookAndFeel().findColour (juce::ResizableWindow::backgroundColourId));
+    pitchSyncButton->setColour(juce::TextButton::textColourOnId, juce::Colours::white);
+    pitchSyncButton->setColour(juce::TextButton::textColourOffId, juce::Colours::darkgrey);
+    
     addAndMakeVisible(randRevSlider = new ParameterSlider(*p.randRev));
     randRevSlider->setSliderStyle(juce::Slider::RotaryHorizontalVerticalDrag);
     randRevSlider->setTextBoxStyle(juce::Slider::TextBoxBelow, false, 80, 20);
@@ -104,6 +130,36 @@ midiKeyboard(p.keyboardState, juce::MidiKeyboardComponent::horizontalKeyboard)
     addAndMakeVisible(blendLabel);
     blendLabel.setText("blend", juce::dontSendNotification);
     
+    addAndMakeVisible(panSlider = new ParameterSlider(*p.pan));
+    panSlider->setSliderStyle(juce::Slider::RotaryHorizontalVerticalDrag);
+    panSlider->setTextBoxStyle(juce::Slider::TextBoxBelow, false, 80, 20);
+    addAndMakeVisible(panLabel);
+    panLabel.setText("pan", juce::dontSendNotification);
+    
+    addAndMakeVisible(widthSlider = new ParameterSlider(*p.width));
+    widthSlider->setSliderStyle(juce::Slider::RotaryHorizontalVerticalDrag);
+    widthSlider->setTextBoxStyle(juce::Slider::TextBoxBelow, false, 80, 20);
+    addAndMakeVisible(widthLabel);
+    widthLabel.setText("width", juce::dontSendNotification);
+    
+    addAndMakeVisible(spreadSlider = new ParameterSlider(*p.spread));
+    spreadSlider->setSliderStyle(juce::Slider::RotaryHorizontalVerticalDrag);
+    spreadSlider->setTextBoxStyle(juce::Slider::TextBoxBelow, false, 80, 20);
+    addAndMakeVisible(spreadLabel);
+    spreadLabel.setText("spread", juce::dontSendNotification);
+    
+    addAndMakeVisible(cutoffSlider = new ParameterSlider(*p.cutoff));
+    cutoffSlider->setSliderStyle(juce::Slider::RotaryHorizontalVerticalDrag);
+    cutoffSlider->setTextBoxStyle(juce::Slider::TextBoxBelow, false, 80, 20);
+    addAndMakeVisible(cutoffLabel);
+    cutoffLabel.setText("cutoff", juce::dontSendNotification);
+    
+    addAndMakeVisible(resonanceSlider = new ParameterSlider(*p.resonance));
+    resonanceSlider->setSliderStyle(juce::Slider::RotaryHorizontalVerticalDrag);
+    resonanceSlider->setTextBoxStyle(juce::Slider::TextBoxBelow, false, 80, 20);
+    addAndMakeVisible(resonanceLabel);
+    resonanceLabel.setText("reso", juce::dontSendNotification);
+    
     addAndMakeVisible(envAttackSlider = new ParameterSlider(*p.envAttack));
     envAttackSlider->setSliderStyle(juce::Slider::RotaryHorizontalVerticalDrag);
     envAttackSlider->setTextBoxStyle(juce::Slider::TextBoxBelow, false, 40, 15);
@@ -123,10 +179,9 @@ midiKeyboard(p.keyboardState, juce::MidiKeyboardComponent::horizontalKeyboard)
     addAndMakeVisible(envCurveLabel);
     envCurveLabel.setText("curve", juce::dontSendNotification);
     
-    formatManager.registerBasicFormats();
     DBG("Call PluginEditor.");
     //keyboardState.addListener (this);
-    thumbnail.addChangeListener(this);
+    audioProcessor.overviewChanged.addChangeListener(this);
     positionSlider->addListener(this);
     envAttackSlider->addListener(this);
     envReleaseSlider->addListener(this);
@@ -137,12 +192,30 @@ midiKeyboard(p.keyboardState, juce::MidiKeyboardComponent::horizontalKeyboard)
     addAndMakeVisible(midiKeyboard);
     midiKeyboard.setVelocity(1, true);
     
-
-    (p.keyboardState).addListener(this);
+    addAndMakeVisible(loadLabel);
+    loadLabel.setJustificationType(juce::Justification::centredRight);
+    addAndMakeVisible(browseButton);
+    browseButton.setClickingTogglesState(true);
+    browseButton.onClick = [this]{ browser.setVisible(browseButton.getToggleState()); };
+    addChildComponent(browser);
+    addAndMakeVisible(previousPresetButton);
+    previousPresetButton.onClick = [this]{ stepPreset(-1); };
+    addAndMakeVisible(nextPresetButton);
+    nextPresetButton.onClick = [this]{ stepPreset(1); };
+    addAndMakeVisible(storePresetButton);
+    storePresetButton.onClick = [this]{ storePreset(); };
+    addAndMakeVisible(presetLabel);
+    presetLabel.setJustificationType(juce::Justification::centred);
+    updatePresetLabel();
+    
+    //the grain cloud follows the audio thread at frame rate
+    startTimerHz(60);
 }
 
 CranulatorAudioProcessorEditor::~CranulatorAudioProcessorEditor()
 {
+    stopTimer();
+    audioProcessor.overviewChanged.removeChangeListener(this);
     delete positionSlider;
     delete randPosSlider;
     delete durationSlider;
@@ -154,8 +227,17 @@ CranulatorAudioProcessorEditor::~CranulatorAudioProcessorEditor()
     delete transposeSlider;
     delete randPitchSlider;
     delete reverseButton;
+    delete liveButton;
+    delete freezeButton;
+    delete spectralButton;
+    delete pitchSyncButton;
     delete randRevSlider;
     delete blendSlider;
+    delete panSlider;
+    delete widthSlider;
+    delete spreadSlider;
+    delete cutoffSlider;
+    delete resonanceSlider;
     
     delete envAttackSlider;
     delete envReleaseSlider;
@@ -172,17 +254,13 @@ void CranulatorAudioProcessorEditor::paint (juce::Graphics& g)
 
     g.setColour (juce::Colours::white);
 
-    juce::Rectangle<int> thumbnailBounds (10, getHeight() - 160, getWidth() - 20, 100);
-    if (thumbnail.getNumChannels() == 0){
-        
-        if (!audioProcessor.filePath.isEmpty()){
-            thumbnail.setSource(new juce::FileInputSource(audioProcessor.filePath));
-            paintIfFileLoaded(g, thumbnailBounds);
-        }else paintIfNoFileLoaded (g, thumbnailBounds);
+    const juce::Rectangle<int> thumbnailBounds = getThumbnailBounds();
+    if (g.clipRegionIntersects(thumbnailBounds)){
+        if (audioProcessor.getOverview() == nullptr && audioProcessor.getFilePath().isEmpty()) paintIfNoFileLoaded (g, thumbnailBounds);
+        else paintIfFileLoaded (g, thumbnailBounds);
     }
-    else paintIfFileLoaded (g, thumbnailBounds);
-    juce::Rectangle<int> envelopeBounds(440, 50, 160, 90);
-    paintEnv(g, envelopeBounds);
+    const juce::Rectangle<int> envelopeBounds = getEnvelopeBounds();
+    if (g.clipRegionIntersects(envelopeBounds)) paintEnv(g, envelopeBounds);
 
     
 }
@@ -218,9 +296,32 @@ void CranulatorAudioProcessorEditor::resized()
     randRevSlider->setBounds(250, 145, 50, 65);
     randRevLabel.setBounds(250, 125, 60, 20);
     reverseButton->setBounds(width - 70, getHeight() - 75, 50, 20);
+    liveButton->setBounds(width - 130, getHeight() - 75, 50, 20);
+    freezeButton->setBounds(width - 190, getHeight() - 75, 50, 20);
+    spectralButton->setBounds(width - 250, getHeight() - 75, 50, 20);
+    pitchSyncButton->setBounds(width - 310, getHeight() - 75, 50, 20);
+    loadLabel.setBounds(width - 390, getHeight() - 75, 70, 20);
+    browseButton.setBounds(width - 450, getHeight() - 75, 50, 20);
+    previousPresetButton.setBounds(10, getHeight() - 75, 20, 20);
+    presetLabel.setBounds(30, getHeight() - 75, 100, 20);
+    nextPresetButton.setBounds(130, getHeight() - 75, 20, 20);
+    storePresetButton.setBounds(155, getHeight() - 75, 40, 20);
+    browser.setBounds(10, 40, width - 20, getHeight() - 210);
     blendSlider->setBounds(370, 60, 50, 65);
     blendLabel.setBounds(370, 40, 50, 20);
     
+    panSlider->setBounds(310, 60, 50, 65);
+    panLabel.setBounds(310, 40, 50, 20);
+    widthSlider->setBounds(310, 145, 50, 65);
+    widthLabel.setBounds(310, 125, 50, 20);
+    spreadSlider->setBounds(370, 145, 50, 65);
+    spreadLabel.setBounds(370, 125, 50, 20);
+    
+    cutoffSlider->setBounds(605, 60, 50, 65);
+    cutoffLabel.setBounds(605, 40, 50, 20);
+    resonanceSlider->setBounds(605, 145, 50, 65);
+    resonanceLabel.setBounds(605, 125, 50, 20);
+    
     envAttackSlider->setBounds(440, 155, 40, 52);
     envAttackLabel.setBounds(440, 140, 40, 15);
     
@@ -240,34 +341,25 @@ void CranulatorAudioProcessorEditor::paintEnv(juce::Graphics &g, const juce::Rec
     float r = *audioProcessor.envRelease;
     float c = *audioProcessor.envCurve;
     g.setColour(juce::Colours::white);
-    //juce::Path p;
-    int envWidth = envBounds.getWidth();
-    float gain;
-    int envBotton = envBounds.getBottom();
-    int envLeft = envBounds.getX();
-    int envHeight = envBounds.getHeight();
-    int val = 0;
-    int prevX,prevY,currentX,currentY;
-
-    for (int i = 0; i < envWidth; i++){
-        
-        //calculate gain
-        gain = envelope(i, envWidth, a, r, c);
-        val = (float)gain * envHeight;
-        if(i == 0){
-            //p.startNewSubPath(envLeft, envBotton);
-            prevX = envLeft;
-            prevY = envBotton;
-        }else {
-            //p.lineTo(envLeft + i, envBotton - val);
-            currentX = envLeft + i;
-            currentY = envBotton - val;
-            g.drawLine(prevX, prevY, currentX, currentY);
-            prevX = currentX;
-            prevY = currentY;
+    //the curve only changes with the envelope knobs, so the exp() per pixel runs once per change
+    if (envPath.isEmpty() || envPathBounds != envBounds || envPathParams[0] != a || envPathParams[1] != r || envPathParams[2] != c){
+        envPath.clear();
+        int envWidth = envBounds.getWidth();
+        int envBotton = envBounds.getBottom();
+        int envLeft = envBounds.getX();
+        int envHeight = envBounds.getHeight();
+        envPath.preallocateSpace(3 * envWidth + 3);
+        envPath.startNewSubPath((float) envLeft, (float) envBotton);
+        for (int i = 1; i < envWidth; i++){
+            int val = (float) envelope(i, envWidth, a, r, c) * envHeight;
+            envPath.lineTo((float) (envLeft + i), (float) (envBotton - val));
         }
+        envPathBounds = envBounds;
+        envPathParams[0] = a;
+        envPathParams[1] = r;
+        envPathParams[2] = c;
     }
-    
+    g.strokePath(envPath, juce::PathStrokeType(1.0f));
 }
 float CranulatorAudioProcessorEditor::envelope(int i, int length, float a, float r, float c){
     float frac = (float) i/length;
@@ -288,20 +380,21 @@ float CranulatorAudioProcessorEditor::envelope(int i, int length, float a, float
 }
 bool CranulatorAudioProcessorEditor::isInterestedInFileDrag(const juce::StringArray & files){
     for(auto file : files){
-        if (file.contains(".wav") || file.contains(".aiff") || file.contains(".aif")) return true;
+        if (audioProcessor.canLoad(file)) return true;
     }
     return false;
 }
 void CranulatorAudioProcessorEditor::filesDropped(const juce::StringArray & files, int x, int y){
+    //only one file plays at a time, so the first one we can read wins
     for (auto file: files){
-        if(isInterestedInFileDrag(files)) {
-            audioProcessor.loadFile(file);
-            thumbnail.setSource(new juce::FileInputSource(file));
+        if (audioProcessor.canLoad(file)) {
+            audioProcessor.requestLoad(file);
+            return;
         }
     }
 }
 void CranulatorAudioProcessorEditor::changeListenerCallback(juce::ChangeBroadcaster *source){
-    if (source == &thumbnail) repaint();
+    if (source == &audioProcessor.overviewChanged) repaint(getThumbnailBounds());
     
 }
 void CranulatorAudioProcessorEditor::paintIfNoFileLoaded(juce::Graphics &g, const juce::Rectangle<int> &thumbnailBounds){
@@ -313,10 +406,27 @@ void CranulatorAudioProcessorEditor::paintIfNoFileLoaded(juce::Graphics &g, cons
     g.drawFittedText("No Sample Loaded, drop wav/aif here...", thumbnailBounds, juce::Justification::centred, 1);
 }
 void CranulatorAudioProcessorEditor::paintIfFileLoaded(juce::Graphics &g, const juce::Rectangle<int> &thumbnailBounds){
-    g.setColour(juce::Colours::darkgrey);
-    g.fillRect(thumbnailBounds);
-    g.setColour(juce::Colours::white);
-    thumbnail.drawChannels(g, thumbnailBounds, 0.0, thumbnail.getTotalLength(), 1.0f);
+    //drawn from the processor's own buffer, it stays blank until the overview is built
+    PeakPyramid::Ptr overview = audioProcessor.getOverview();
+    const float scale = g.getInternalContext().getPhysicalPixelScaleFactor();
+    if (overview != waveformImageSource || scale != waveformImageScale
+        || waveformImage.getWidth() != juce::roundToInt(thumbnailBounds.getWidth() * scale)
+        || waveformImage.getHeight() != juce::roundToInt(thumbnailBounds.getHeight() * scale)){
+        //rendered at the display's pixel density so it stays sharp, then only blitted while the playhead moves
+        waveformImage = juce::Image(juce::Image::RGB, juce::jmax(1, juce::roundToInt(thumbnailBounds.getWidth() * scale)),
+                                    juce::jmax(1, juce::roundToInt(thumbnailBounds.getHeight() * scale)), false);
+        juce::Graphics ig(waveformImage);
+        ig.addTransform(juce::AffineTransform::scale(scale));
+        const juce::Rectangle<int> imageBounds(0, 0, thumbnailBounds.getWidth(), thumbnailBounds.getHeight());
+        ig.setColour(juce::Colours::darkgrey);
+        ig.fillRect(imageBounds);
+        ig.setColour(juce::Colours::white);
+        if (overview != nullptr) overview->drawChannels(ig, imageBounds, 0, overview->getNumSamples(), 1.0f);
+        waveformImageSource = overview;
+        waveformImageScale = scale;
+    }
+    g.drawImage(waveformImage, thumbnailBounds.toFloat());
+    paintGrains(g, thumbnailBounds);
     g.setColour(juce::Colours::green);
     float audioPosition = (float) positionSlider->getValue();
     auto drawPosition = (audioPosition * thumbnailBounds.getWidth()) + thumbnailBounds.getX();
@@ -325,6 +435,55 @@ void CranulatorAudioProcessorEditor::paintIfFileLoaded(juce::Graphics &g, const
     
 }
 
+void CranulatorAudioProcessorEditor::paintGrains(juce::Graphics &g, const juce::Rectangle<int> &thumbnailBounds){
+    //each grain is a bar over the part of the file it covers, raised by its gain, with a dot where it reads now
+    const GrainSnapshot& snapshot = audioProcessor.grainSnapshots.getReadBuffer();
+    if (snapshot.numEntries == 0) return;
+    juce::Graphics::ScopedSaveState save(g);
+    g.reduceClipRegion(thumbnailBounds);
+    const float left = (float) thumbnailBounds.getX();
+    const float width = (float) thumbnailBounds.getWidth();
+    const float bottom = (float) thumbnailBounds.getBottom();
+    const float height = (float) thumbnailBounds.getHeight();
+    for (int i = 0; i < snapshot.numEntries; i++){
+        const GrainSnapshot::Entry& e = snapshot.entries[i];
+        const float gain = juce::jlimit(0.0f, 1.0f, e.gain);
+        const float y = bottom - gain * height;
+        g.setColour((e.span < 0 ? juce::Colours::cyan : juce::Colours::orange).withAlpha(0.25f + 0.5f * gain));
+        g.drawLine(left + e.start * width, y, left + (e.start + e.span) * width, y, 1.0f);
+        g.fillEllipse(left + e.head * width - 1.5f, y - 1.5f, 3.0f, 3.0f);
+    }
+}
+void CranulatorAudioProcessorEditor::timerCallback(){
+    if (audioProcessor.grainSnapshots.update()) repaint(getThumbnailBounds());
+    //the render load is only worth reading a few times a second
+    if (++loadTicks % 15 == 0)
+        loadLabel.setText("dsp " + juce::String(juce::roundToInt(100.0 * audioProcessor.getRenderLoad())) + "%", juce::dontSendNotification);
+    //the host and program change messages switch presets too
+    if (loadTicks % 15 == 0) updatePresetLabel();
+}
+
+void CranulatorAudioProcessorEditor::stepPreset(int delta){
+    const int index = juce::jlimit(0, PresetBank::numSlots - 1, audioProcessor.getCurrentProgram() + delta);
+    audioProcessor.setCurrentProgram(index);
+    audioProcessor.updateHostDisplay();
+    updatePresetLabel();
+}
+
+void CranulatorAudioProcessorEditor::storePreset(){
+    //a slot keeps its name, an empty one is named after the file
+    const int index = audioProcessor.getCurrentProgram();
+    const PresetBank::Preset old = audioProcessor.presets.get(index);
+    const juce::String name = old.name.isNotEmpty() ? old.name : juce::File(audioProcessor.getFilePath()).getFileNameWithoutExtension();
+    audioProcessor.storePreset(index, name);
+    updatePresetLabel();
+}
+
+void CranulatorAudioProcessorEditor::updatePresetLabel(){
+    const int index = audioProcessor.getCurrentProgram();
+    presetLabel.setText(audioProcessor.getProgramName(index), juce::dontSendNotification);
+}
+
 void CranulatorAudioProcessorEditor::buttonClicked (juce::Button* button){
     if (button == reverseButton) click_reverse();
 }
@@ -338,13 +497,3 @@ void CranulatorAudioProcessorEditor::click_reverse(){
     }
 }
 
-void CranulatorAudioProcessorEditor::handleNoteOn(juce::MidiKeyboardState *source, int midiChannel, int midiNoteNumber, float velocity){
-    //std::cout << midiNoteNumber << " on, vel" << (int) (velocity * 127.0f) << std::endl;
-    audioProcessor.midiNotes[midiNoteNumber] = (int) (velocity * 127.0f);
-    audioProcessor.noteOn = true;
-}
-void CranulatorAudioProcessorEditor::handleNoteOff(juce::MidiKeyboardState *source, int midiChannel, int midiNoteNumber, float velocity){
-    //std::cout << midiNoteNumber << " off" <<  std::endl;
-    audioProcessor.midiNotes[midiNoteNumber] = 0;
-    //audioProcessor.noteOn = false;
-}
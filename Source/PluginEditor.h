@@ -10,27 +10,27 @@
 
 #include <JuceHeader.h>
 #include "PluginProcessor.h"
+#include "ParameterRefresh.h"
+#include "SampleBrowser.h"
 
 //==============================================================================
 /**
 */
-class ParameterSlider: public juce::Slider, private juce::Timer{
+class ParameterSlider: public juce::Slider, private ParameterRefreshDriver::Client{
 public:
     juce::AudioProcessorParameter& param;
-    ParameterSlider(juce::AudioProcessorParameter& p) : juce::Slider(p.getName(256)), param(p){
+    ParameterSlider(juce::AudioProcessorParameter& p) : juce::Slider(p.getName(256)), ParameterRefreshDriver::Client(p), param(p){
         setRange(0.0f, 1.0f, 0.0f);
-        startTimerHz(60);
         updateSliderPos();
     }
-    ParameterSlider(juce::AudioProcessorParameter& p, float min, float max, float range) : juce::Slider(p.getName(256)), param(p){
+    ParameterSlider(juce::AudioProcessorParameter& p, float min, float max, float range) : juce::Slider(p.getName(256)), ParameterRefreshDriver::Client(p), param(p){
         setRange(min, max, range);
-        startTimerHz(60);
         updateSliderPos();
     }
     bool isDragging = false;
     void startedDragging() override{ param.beginChangeGesture(); isDragging = true;}
     void stoppedDragging() override{ param.endChangeGesture();   isDragging = false;}
-    void timerCallback() override{updateSliderPos();}
+    void refresh() override{updateSliderPos();}
     void updateSliderPos(){
         const float newVal = param.getValue();
         if (newVal != (float) juce::Slider::getValue()) {Slider::setValue(newVal);}
@@ -44,14 +44,13 @@ public:
     juce::String getTextFromValue(double val) override{return param.getText(float(val), 1024);}
 };
 
-class ParameterButton: public juce::TextButton, private juce::Timer{
+class ParameterButton: public juce::TextButton, private ParameterRefreshDriver::Client{
 public:
     juce::AudioProcessorParameter& param;
-    ParameterButton(juce::AudioProcessorParameter& p) : juce::TextButton(p.getName(256)), param(p){
+    ParameterButton(juce::AudioProcessorParameter& p) : juce::TextButton(p.getName(256)), ParameterRefreshDriver::Client(p), param(p){
         updateButton();
-        startTimerHz(60);
     }
-    void timerCallback() override{updateButton();}
+    void refresh() override{updateButton();}
     void updateButton(){
         const bool newVal = param.getValue();
         if (newVal != juce::TextButton::getToggleState())
@@ -65,7 +64,7 @@ public juce::FileDragAndDropTarget,
 private juce::Button::Listener,
 private juce::Slider::Listener,
 private juce::ChangeListener,
-private juce::MidiKeyboardStateListener
+private juce::Timer
 {
 public:
     CranulatorAudioProcessorEditor (CranulatorAudioProcessor&);
@@ -79,9 +78,9 @@ public:
     bool isInterestedInFileDrag(const juce::StringArray & files) override;
     void filesDropped(const juce::StringArray & files, int x, int y) override;
     void sliderValueChanged (juce::Slider* slider) override{
-        if(slider == positionSlider || randPosSlider){
-            repaint();
-        }
+        //only the panel showing the changed value is redrawn, the knob repaints itself
+        if(slider == positionSlider) repaint(getThumbnailBounds());
+        else if(slider == envAttackSlider || slider == envReleaseSlider || slider == envCurveSlider) repaint(getEnvelopeBounds());
     };
     void buttonClicked (juce::Button* button) override;
     void click_reverse();
@@ -89,8 +88,8 @@ public:
     void paintIfNoFileLoaded (juce::Graphics& g, const juce::Rectangle<int>& thumbnailBounds);
     void paintIfFileLoaded (juce::Graphics& g, const juce::Rectangle<int>& thumbnailBounds);
     void paintEnv(juce::Graphics& g, const juce::Rectangle<int>& envBounds);
-    void handleNoteOn(juce::MidiKeyboardState * source, int midiChannel, int midiNoteNumber, float velocity) override;
-    void handleNoteOff(juce::MidiKeyboardState * source, int midiChannel, int midiNoteNumber, float velocity) override;
+    void paintGrains(juce::Graphics& g, const juce::Rectangle<int>& thumbnailBounds);
+    void timerCallback() override;
     
     
 private:
@@ -99,9 +98,25 @@ private:
     CranulatorAudioProcessor& audioProcessor;
     
     float envelope(int index, int length, float a, float r, float c);
+    juce::Rectangle<int> getThumbnailBounds() const {return {10, getHeight() - 160, getWidth() - 20, 100};}
+    juce::Rectangle<int> getEnvelopeBounds() const {return {440, 50, 160, 90};}
+    
+    //pre-rendered panels, rebuilt only when what they show changes
+    juce::Image waveformImage;
+    PeakPyramid::Ptr waveformImageSource;
+    float waveformImageScale = 0;
+    juce::Path envPath;
+    juce::Rectangle<int> envPathBounds;
+    float envPathParams[3] = {-1, -1, -1};
     
 
     ParameterButton* reverseButton;
+    ParameterButton* liveButton;
+    ParameterButton* freezeButton;
+    ParameterButton* spectralButton;
+    ParameterButton* pitchSyncButton;
+    juce::Label loadLabel;
+    int loadTicks = 0;
     ParameterSlider* randRevSlider;
     juce::Label randRevLabel;
     ParameterSlider* positionSlider;
@@ -125,6 +140,16 @@ private:
     juce::Label randPitchLabel;
     ParameterSlider* blendSlider;
     juce::Label blendLabel;
+    ParameterSlider* panSlider;
+    juce::Label panLabel;
+    ParameterSlider* widthSlider;
+    juce::Label widthLabel;
+    ParameterSlider* spreadSlider;
+    juce::Label spreadLabel;
+    ParameterSlider* cutoffSlider;
+    juce::Label cutoffLabel;
+    ParameterSlider* resonanceSlider;
+    juce::Label resonanceLabel;
     ParameterSlider* envAttackSlider;
     juce::Label envAttackLabel;
     ParameterSlider* envReleaseSlider;
@@ -133,13 +158,17 @@ private:
     juce::Label envCurveLabel;
 
     
-    //Thumbnail
-    juce::AudioThumbnailCache thumbnailCache;
-    juce::AudioThumbnail thumbnail;
-    
     //Utilities
-    juce::AudioFormatManager formatManager;
     juce::MidiKeyboardComponent midiKeyboard;
+    //the sample browser covers the knobs while it is open
+    juce::TextButton browseButton {"browse"};
+    SampleBrowser browser;
+    //steps through the preset bank, store keeps the current knobs and file in the shown slot
+    juce::TextButton previousPresetButton {"<"}, nextPresetButton {">"}, storePresetButton {"store"};
+    juce::Label presetLabel;
+    void stepPreset(int delta);
+    void storePreset();
+    void updatePresetLabel();
     //juce::MidiKeyboardState keyboardState;
     JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (CranulatorAudioProcessorEditor)
 };
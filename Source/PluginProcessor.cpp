@@ -52,8 +52,87 @@ CranulatorAudioProcessor::CranulatorAudioProcessor()
     addParameter(envRelease = new juce::AudioParameterFloat(juce::ParameterID{"RELEASE", 1}, "release", 0.0f, 0.5f, 0.3f));
     addParameter(envCurve = new juce::AudioParameterFloat(juce::ParameterID{"CURVE", 1}, "curve", -5.0f, 5.0f, 0.0f));
     addParameter(randRev = new juce::AudioParameterFloat(juce::ParameterID{"RAND_REV", 1}, "rand_rev", 0.0f, 1.0f, 1.0f));
+    addParameter(cullLevel = new juce::AudioParameterFloat(juce::ParameterID{"CULL", 1}, "cull", -120.0f, -30.0f, -80.0f));
+    addParameter(liveInput = new juce::AudioParameterBool(juce::ParameterID{"LIVE", 1}, "Live input", false));
+    addParameter(pan = new juce::AudioParameterFloat(juce::ParameterID{"PAN", 1}, "pan", -1.0f, 1.0f, 0.0f));
+    addParameter(spread = new juce::AudioParameterFloat(juce::ParameterID{"SPREAD", 1}, "spread", 0.0f, 1.0f, 0.0f));
+    addParameter(width = new juce::AudioParameterFloat(juce::ParameterID{"WIDTH", 1}, "width", 0.0f, 1.0f, 1.0f));
+    addParameter(releaseTail = new juce::AudioParameterFloat(juce::ParameterID{"TAIL", 1}, "tail",
+                                                             juce::NormalisableRange<float>
+                                                             (0.0f, 5.0f, 0.001f, 0.5f), 0.5f));
+    addParameter(filterMode = new juce::AudioParameterChoice(juce::ParameterID{"FILTER", 1}, "filter",
+                                                             juce::StringArray{"off", "lowpass", "bandpass", "highpass"}, 0));
+    addParameter(cutoff = new juce::AudioParameterFloat(juce::ParameterID{"CUTOFF", 1}, "cutoff",
+                                                        juce::NormalisableRange<float>
+                                                        (20.0f, 20000.0f, 0.1f, 0.25f), 1000.0f));
+    addParameter(resonance = new juce::AudioParameterFloat(juce::ParameterID{"RESO", 1}, "resonance",
+                                                           juce::NormalisableRange<float>
+                                                           (0.5f, 20.0f, 0.001f, 0.4f), 0.707f));
+    addParameter(randCutoff = new juce::AudioParameterFloat(juce::ParameterID{"RAND_CUTOFF", 1}, "rand_cutoff", 0.0f, 1.0f, 0.0f));
+    
+    //anything a grain is built from can be modulated, the freeze render keeps a matrix of its own
+    auto addModDestination = [this](const juce::String& name, const juce::RangedAudioParameter& param, float GrainParams::* field){
+        modMatrix.addDestination(name, param, field);
+        freezeMods.addDestination(name, param, field);
+    };
+    addModDestination("position", *position, &GrainParams::position);
+    addModDestination("rand pos", *randPos, &GrainParams::randPos);
+    addModDestination("duration", *duration, &GrainParams::duration);
+    addModDestination("rand dur", *randDur, &GrainParams::randDur);
+    addModDestination("volume", *volume, &GrainParams::volume);
+    addModDestination("rand gain", *randGain, &GrainParams::randGain);
+    addModDestination("density", *density, &GrainParams::density);
+    addModDestination("rand dens", *randDens, &GrainParams::randDens);
+    addModDestination("pitch", *transpose, &GrainParams::transpose);
+    addModDestination("rand pitch", *randPitch, &GrainParams::randPitch);
+    addModDestination("rand rev", *randRev, &GrainParams::randRev);
+    addModDestination("attack", *envAttack, &GrainParams::envAttack);
+    addModDestination("release", *envRelease, &GrainParams::envRelease);
+    addModDestination("curve", *envCurve, &GrainParams::envCurve);
+    addModDestination("pan", *pan, &GrainParams::pan);
+    addModDestination("spread", *spread, &GrainParams::spread);
+    addModDestination("width", *width, &GrainParams::width);
+    addModDestination("cutoff", *cutoff, &GrainParams::cutoff);
+    addModDestination("resonance", *resonance, &GrainParams::resonance);
+    addModDestination("rand cutoff", *randCutoff, &GrainParams::randCutoff);
+    for (int l = 0; l < ModMatrix::numLfos; l++){
+        const juce::String n (l + 1);
+        addParameter(lfoRate[l] = new juce::AudioParameterFloat(juce::ParameterID{"LFO" + n + "_RATE", 1}, "lfo " + n + " rate",
+                                                                juce::NormalisableRange<float>
+                                                                (0.01f, 20.0f, 0.001f, 0.3f), 1.0f));
+        addParameter(lfoShape[l] = new juce::AudioParameterChoice(juce::ParameterID{"LFO" + n + "_SHAPE", 1}, "lfo " + n + " shape",
+                                                                  ModMatrix::getShapeNames(), 0));
+    }
+    addParameter(randomRate = new juce::AudioParameterFloat(juce::ParameterID{"RND_RATE", 1}, "random rate",
+                                                            juce::NormalisableRange<float>
+                                                            (0.01f, 50.0f, 0.001f, 0.3f), 4.0f));
+    addParameter(modEnvAttack = new juce::AudioParameterFloat(juce::ParameterID{"MENV_ATTACK", 1}, "mod env attack", 0.0f, 5.0f, 0.5f));
+    addParameter(modEnvDecay = new juce::AudioParameterFloat(juce::ParameterID{"MENV_DECAY", 1}, "mod env decay", 0.0f, 5.0f, 0.5f));
+    addParameter(modEnvSustain = new juce::AudioParameterFloat(juce::ParameterID{"MENV_SUSTAIN", 1}, "mod env sustain", 0.0f, 1.0f, 0.5f));
+    for (int s = 0; s < ModMatrix::numSlots; s++){
+        const juce::String n (s + 1);
+        addParameter(modSource[s] = new juce::AudioParameterChoice(juce::ParameterID{"MOD" + n + "_SRC", 1}, "mod " + n + " source",
+                                                                   ModMatrix::getSourceNames(), 0));
+        addParameter(modDestination[s] = new juce::AudioParameterChoice(juce::ParameterID{"MOD" + n + "_DST", 1}, "mod " + n + " destination",
+                                                                        modMatrix.getDestinationNames(), 0));
+        addParameter(modDepth[s] = new juce::AudioParameterFloat(juce::ParameterID{"MOD" + n + "_AMT", 1}, "mod " + n + " depth", -1.0f, 1.0f, 0.0f));
+    }
+    addParameter(freeze = new juce::AudioParameterBool(juce::ParameterID{"FREEZE", 1}, "Freeze", false));
+    addParameter(freezeLength = new juce::AudioParameterFloat(juce::ParameterID{"FREEZE_LEN", 1}, "freeze length", 1.0f, 20.0f, 8.0f));
+    addParameter(spectral = new juce::AudioParameterBool(juce::ParameterID{"SPECTRAL", 1}, "Spectral", false));
+    addParameter(placement = new juce::AudioParameterChoice(juce::ParameterID{"PLACE", 1}, "placement",
+                                                            SourceIndex::getPlacementNames(), 0));
+    addParameter(pitchSync = new juce::AudioParameterBool(juce::ParameterID{"PSYNC", 1}, "Pitch sync", false));
+    addParameter(interpolation = new juce::AudioParameterChoice(juce::ParameterID{"INTERP", 1}, "interpolation",
+                                                                CircularRead::getInterpolationNames(), 0));
+    addParameter(offlineInterpolation = new juce::AudioParameterChoice(juce::ParameterID{"INTERP_OFFLINE", 1}, "offline interpolation",
+                                                                       CircularRead::getInterpolationNames(), 3));
+    //the sinc tables are built here rather than by the first grain that reads them
+    CircularRead::SincTable<8, float>::get();
+    CircularRead::SincTable<16, float>::get();
+    CircularRead::SincTable<8, double>::get();
+    CircularRead::SincTable<16, double>::get();
     time = 0;
-    schedDelay = 700;
     formatManager.registerBasicFormats();
     binsPerOctave = 12.0f;
     noteOn = false;
@@ -65,6 +144,9 @@ CranulatorAudioProcessor::CranulatorAudioProcessor()
 CranulatorAudioProcessor::~CranulatorAudioProcessor()
 {
     stopThread(5000);
+    freezeCache.invalidate();
+    analysisQueue.clear(5000);
+    warmingQueue.clear(5000);
     juce::Logger::setCurrentLogger(nullptr);
     delete crLog;
 }
@@ -109,26 +191,31 @@ double CranulatorAudioProcessor::getTailLengthSeconds() const
 
 int CranulatorAudioProcessor::getNumPrograms()
 {
-    return 1;   // NB: some hosts don't cope very well if you tell them there are 0 programs,
-                // so this should be at least 1, even if you're not really implementing programs.
+    return PresetBank::numSlots;
 }
 
 int CranulatorAudioProcessor::getCurrentProgram()
 {
-    return 0;
+    return currentPreset.load();
 }
 
 void CranulatorAudioProcessor::setCurrentProgram (int index)
 {
+    //the scheduler readies the file, the audio thread swaps at its next block
+    if (!juce::isPositiveAndBelow(index, PresetBank::numSlots)) return;
+    currentPreset = index;
+    wantedPreset = index;
+    notify();
 }
 
 const juce::String CranulatorAudioProcessor::getProgramName (int index)
 {
-    return {};
+    return presets.getName(index);
 }
 
 void CranulatorAudioProcessor::changeProgramName (int index, const juce::String& newName)
 {
+    presets.rename(index, newName);
 }
 
 //==============================================================================
@@ -137,6 +224,19 @@ void CranulatorAudioProcessor::prepareToPlay (double sampleRate, int samplesPerB
     // Use this method as the place to do any pre-playback
     // initialisation that you need..
     fs = sampleRate;
+    loadMeasurer.reset(sampleRate, samplesPerBlock);
+    modMatrix.prepare(sampleRate);
+    freezeMods.prepare(sampleRate);
+    freezeCache.prepare(juce::jmax(getTotalNumInputChannels(), getTotalNumOutputChannels()), samplesPerBlock, sampleRate);
+    if (isUsingDoublePrecision() && fileBuffer != nullptr) fileBuffer->prepareDoublePrecision();
+    //the switch, preview and warm files belong to the scheduler, which readies them before it next hands one over
+    precisionWanted.store(true);
+    notify();
+    capture.prepare(getTotalNumInputChannels(), sampleRate, captureSeconds, samplesPerBlock, isUsingDoublePrecision());
+    speakerLayout = SpeakerLayout(getChannelLayoutOfBus(false, 0));
+    //fixed seeds rather than the system's, so renders at different block sizes can be compared sample for sample
+    random.setSeed(randomSeed);
+    for (int i = 0; i < GrainVoice::maxVoices; i++) voices[i].random.setSeed(randomSeed + 1 + i);
 }
 
 void CranulatorAudioProcessor::releaseResources()
@@ -152,17 +252,22 @@ bool CranulatorAudioProcessor::isBusesLayoutSupported (const BusesLayout& layout
     juce::ignoreUnused (layouts);
     return true;
   #else
-    // This is the place where you check if the layout is supported.
-    // In this template code we only support mono or stereo.
+    // Mono and stereo, plus the layouts the grains can be panned around.
     // Some plugin hosts, such as certain GarageBand versions, will only
     // load plugins that support stereo bus layouts.
-    if (layouts.getMainOutputChannelSet() != juce::AudioChannelSet::mono()
-     && layouts.getMainOutputChannelSet() != juce::AudioChannelSet::stereo())
+    const juce::AudioChannelSet out = layouts.getMainOutputChannelSet();
+    if (out != juce::AudioChannelSet::mono()
+     && out != juce::AudioChannelSet::stereo()
+     && out != juce::AudioChannelSet::quadraphonic()
+     && out != juce::AudioChannelSet::create5point1()
+     && out != juce::AudioChannelSet::create7point1()
+     && out != juce::AudioChannelSet::ambisonic(1))
         return false;
 
-    // This checks if the input layout matches the output layout
+    // The input matches the output, or is a mono/stereo source feeding a wider output
    #if ! JucePlugin_IsSynth
-    if (layouts.getMainOutputChannelSet() != layouts.getMainInputChannelSet())
+    const juce::AudioChannelSet in = layouts.getMainInputChannelSet();
+    if (in != out && in != juce::AudioChannelSet::mono() && in != juce::AudioChannelSet::stereo())
         return false;
    #endif
 
@@ -171,7 +276,13 @@ bool CranulatorAudioProcessor::isBusesLayoutSupported (const BusesLayout& layout
 }
 #endif
 
-void CranulatorAudioProcessor::processBlock (juce::AudioBuffer<float>& buffer, juce::MidiBuffer& midiMessages)
+bool CranulatorAudioProcessor::supportsDoublePrecisionProcessing() const
+{
+    return true;
+}
+
+template <typename SampleType>
+void CranulatorAudioProcessor::processBlockInternal (juce::AudioBuffer<SampleType>& buffer, juce::MidiBuffer& midiMessages)
 {
     //juce::ScopedNoDenormals noDenormals;
     auto totalNumInputChannels  = getTotalNumInputChannels();
@@ -186,70 +297,184 @@ void CranulatorAudioProcessor::processBlock (juce::AudioBuffer<float>& buffer, j
    
     for (auto i = totalNumInputChannels; i < totalNumOutputChannels; i++)
         buffer.clear (i, 0, numSamplesInBlock);
-    processMidi(midiMessages, numSamplesInBlock);
+    //notes played on the editor's keyboard join the host's
+    keyboardState.processNextMidiBuffer(midiMessages, 0, numSamplesInBlock, true);
+    //a preset switch sets the knobs and the file together, before anything reads either
+    takePresetSwitch();
+    //JUCE hands parameters over between blocks, so one snapshot holds for the whole block
+    const GrainParams params = readParams();
+    
+    
+    //in live mode the grains read the capture ring, which is recorded before anything else so it never misses a block
+    const bool live = params.live;
+    juce::ReferenceCountedObjectPtr<ReferenceCountedBuffer> retainedBuffer (live ? capture.getRing() : fileBuffer);
+    const bool ready = retainedBuffer != nullptr && retainedBuffer->isReadyFor<SampleType>();
+    if (!ready){
+        //nothing to play yet, notes still start and stop so a file loaded under held keys sounds at once
+        for (const auto meta : midiMessages) handleMidiEvent(meta.getMessage(), time + meta.samplePosition, params);
+        endPresetFade();
+        //a file handed over before the host went to double precision gets its copy on the scheduler
+        if (retainedBuffer != nullptr && !precisionWanted.exchange(true)) notify();
+        return;
+    }
+    
+    const ReferenceCountedBuffer& currentBuffer = *retainedBuffer;
+    if (live) capture.write(buffer, totalNumInputChannels, time);
+    
+    
+    const int numSamplesInFile  = currentBuffer.getNumSamples();
+    const long long int blockStart = time;
+    const long long int blockEnd = time + numSamplesInBlock;
+    
+    //held voices follow the knobs, released ones keep what they had when the key went up
+    bool anyVoice = false, anyHeld = false, anyReleasing = false;
+    for (GrainVoice& voice : voices){
+        if (voice.state == GrainVoice::State::held) voice.params = params;
+        anyVoice |= voice.state != GrainVoice::State::free;
+        anyHeld |= voice.state == GrainVoice::State::held;
+        anyReleasing |= voice.state == GrainVoice::State::releasing;
+    }
     
+    //spectral grains need the file's spectrum, until it is there the grains stay in the time domain
+    const SpectralFrames* frames = nullptr;
+    if (params.spectral && !live){
+        if (spectrum == nullptr || spectrum->getSource() != &currentBuffer){
+            const juce::SpinLock::ScopedTryLockType tl(spectrumLock);
+            if (tl.isLocked() && publishedSpectrum != nullptr && publishedSpectrum->getSource() == &currentBuffer) spectrum = publishedSpectrum;
+        }
+        if (spectrum != nullptr && spectrum->getSource() == &currentBuffer) frames = spectrum.get();
+        else if (spectrumRequestedFor != &currentBuffer){
+            spectrumRequestedFor = &currentBuffer;
+            spectrumWanted.store(true);
+            notify();
+        }
+    }
+    if (!params.spectral) spectrumRequestedFor = nullptr;
+    if (frames == nullptr) spectralGrains.clear();
+    //placement needs the file's index too, grains go where the knobs say until it is there
+    if (!live && (sourceIndex == nullptr || sourceIndex->getSource() != &currentBuffer)){
+        const juce::SpinLock::ScopedTryLockType tl(indexLock);
+        if (tl.isLocked() && publishedIndex != nullptr && publishedIndex->getSource() == &currentBuffer){
+            sourceIndex = publishedIndex;
+            audioIndex = sourceIndex.get();
+            notify();
+        }
+    }
+    const bool indexed = !live && sourceIndex != nullptr && sourceIndex->getSource() == &currentBuffer;
+    const SourceIndex* index = indexed ? sourceIndex.get() : nullptr;
     
-    juce::ReferenceCountedObjectPtr<ReferenceCountedBuffer> retainedBuffer (fileBuffer);
-    if (retainedBuffer == nullptr) return;
+    //nothing held or fading, every grain has finished and no note is coming, skip the engine
+    if (!anyVoice && grainPool.size() == 0 && spectralGrains.size() == 0 && fadeLeft == 0 && midiMessages.isEmpty()){
+        noteOn = false;
+        processIdle(buffer, numSamplesInFile, live);
+        return;
+    }
     
-    juce::AudioSampleBuffer* currentBuffer = retainedBuffer->get();
+    //the input is already in the ring and comes back as the dry signal below
+    if (live) buffer.clear();
+    const ModMatrix::Settings modSettings = readModSettings();
+    modMatrix.process(blockStart, numSamplesInBlock, modSettings);
     
+    //a cloud of held notes whose knobs sit still can be looped, a release tail changes by definition
+    const FreezeKey freezeKey {params, modSettings, &currentBuffer, buffer.getNumChannels(), noteGeneration, freezeLength->get()};
+    freezeCache.update(freezeKey, *freeze && !live && !params.spectral && anyHeld && !anyReleasing, blockStart);
+    if (FreezeRequest* request = freezeCache.beginRequest(blockStart)){
+        std::copy(std::begin(voices), std::end(voices), std::begin(request->voices));
+        request->mods = modSettings;
+        request->layout = speakerLayout;
+        request->source = retainedBuffer;
+        request->index = indexed ? sourceIndex : nullptr;
+        request->numChannels = buffer.getNumChannels();
+        request->start = blockStart;
+        request->loopLength = (int) (freezeKey.seconds * fs);
+        request->fadeLength = juce::jmin((int) fs, request->loopLength / 4);
+        request->warmUp = (int) (FreezeCache::warmUpSeconds * fs);
+        freezeCache.postRequest();
+        notify();
+    }
+    GrainSnapshot& snapshot = grainSnapshots.getWriteBuffer();
+    snapshot.numEntries = 0;
+    const float fileRecip = 1.0f / numSamplesInFile;
+    rate = pow(2, *transpose / binsPerOctave);
+    const SampleType b = *blend;
     
-    const juce::Array<Grain> stack = grains;
-    const int numSamplesInFile  = currentBuffer->getNumSamples();
-    bool checkNoteOn = false;
-    for(int i = 0; i < 128; i++){
-        if (midiNotes[i] > 0) checkNoteOn = true;
-    }
-    if (!checkNoteOn) noteOn = false;
-    for( int i = 0; i < numSamplesInBlock; i++){
+    //split the block at every MIDI event, so each stretch is spawned, rendered and mixed with the
+    //voices as they are at that sample and the result does not depend on the host's block size
+    auto event = midiMessages.cbegin();
+    int segmentStart = 0;
+    while (segmentStart < numSamplesInBlock){
+        for (; event != midiMessages.cend() && (*event).samplePosition <= segmentStart; ++event)
+            handleMidiEvent((*event).getMessage(), blockStart + segmentStart, params);
+        const int segmentEnd = event != midiMessages.cend() ? juce::jmin(numSamplesInBlock, (*event).samplePosition) : numSamplesInBlock;
+        const int numSamples = segmentEnd - segmentStart;
+        const long long int segmentTime = blockStart + segmentStart;
+        //a view of this stretch of the block, the channel pointers live inside the AudioBuffer so nothing is allocated
+        juce::AudioBuffer<SampleType> segment (buffer.getArrayOfWritePointers(), buffer.getNumChannels(), segmentStart, numSamples);
         
-        for (int g = 0; g < stack.size(); g++){
-            if(stack[g].onset < time){
-                if(time < (stack[g].onset + stack[g].length)){
-                    stack[g].process(buffer, *currentBuffer,  buffer.getNumChannels(), numSamplesInBlock, numSamplesInFile, time);
-                }
+        noteOn = false;
+        for (GrainVoice& voice : voices){
+            if (voice.state != GrainVoice::State::free)
+                spawnGrains(voice, currentBuffer, segment.getNumChannels(), segmentTime + numSamples, grainPool, modMatrix, speakerLayout, index,
+                            frames != nullptr ? &spectralGrains : nullptr);
+            if (voice.state == GrainVoice::State::held) noteOn = true;
+        }
+        if (segmentStart == 0){
+            for (int g = 0; g < grainPool.size() && snapshot.numEntries < GrainSnapshot::capacity; g++){
+                const Grain& grain = grainPool[g];
+                if (grain.onset <= blockStart && blockStart < grain.end())
+                    snapshot.entries[snapshot.numEntries++] = grain.snapshotAt(blockStart, fileRecip);
             }
         }
-        //check BAD val
-        rate = pow(2, *transpose / binsPerOctave);
-        float rev_p = *reverse? -1 : 1;
-
-        if (currentPos < 0) currentPos += (float)numSamplesInFile;
-        int pos1 = (int) currentPos;
-        int pos2 = currentPos + (int)rev_p;
-        float frac = rev_p* (currentPos - (float) pos1);
         
-        for(int c = 0; c < buffer.getNumChannels(); c++){
-            float* channelData = buffer.getWritePointer(c);
-            float currentSample = channelData[i];
-//            for(int g = 0; g < stack.size(); g++){
-//                if(currentSample > 1.0 || currentSample < -1.0){
-//                    std::cout<<"badsample " << currentSample << ", dump "<<stack.size() << "grains"<<std::endl;
-//                }
-//            }
-            float dry = 0;
-            if(noteOn){
-                const float* fileData = currentBuffer->getReadPointer(c%currentBuffer->getNumChannels());
-                float sample1 = fileData[pos1 % numSamplesInFile];
-                float sample2 = fileData[pos2 % numSamplesInFile];
-                dry = linearInterp(frac, sample1, sample2);
+        //grains keep being spawned while frozen, so the live cloud is ready whenever the loop fades out
+        float frozen0, frozen1;
+        freezeCache.advance(numSamples, frozen0, frozen1);
+        juce::AudioBuffer<SampleType>& scratch = freezeCache.getScratch<SampleType>();
+        if ((frozen0 == 0 && frozen1 == 0) || scratch.getNumSamples() == 0){
+            grainFilters.render(grainPool, segment, currentBuffer, segmentTime);
+            if (frames != nullptr) spectralGrains.render(*frames, segment, segmentTime);
+        }else if (frozen0 < 1 || frozen1 < 1){
+            //crossfading, the live grains are rendered apart so the ramp leaves the input alone
+            for (int done = 0; done < numSamples; done += scratch.getNumSamples()){
+                const int n = juce::jmin(numSamples - done, scratch.getNumSamples());
+                juce::AudioBuffer<SampleType> part (scratch.getArrayOfWritePointers(), segment.getNumChannels(), 0, n);
+                part.clear();
+                grainFilters.render(grainPool, part, currentBuffer, segmentTime + done);
+                if (frames != nullptr) spectralGrains.render(*frames, part, segmentTime + done);
+                const float g0 = 1.0f - juce::jmap((float) done / numSamples, frozen0, frozen1);
+                const float g1 = 1.0f - juce::jmap((float) (done + n) / numSamples, frozen0, frozen1);
+                for (int c = 0; c < segment.getNumChannels(); c++)
+                    segment.addFromWithRamp(c, done, part.getReadPointer(c), n, (SampleType) g0, (SampleType) g1);
             }
-            currentSample *= *blend;
-            currentSample += (1 - *blend) * dry;
-            channelData[i] = clip(currentSample, -1.0f, 1.0f);
         }
-        if(noteOn){
-            //std::cout<< currentPos << " " << rate << " " << *transpose << " " << std::endl;
-            currentPos += (float)rev_p * rate;
-            if (currentPos > numSamplesInFile) currentPos-= (float)numSamplesInFile;
+        freezeCache.addFrozen(segment, segmentTime, frozen0, frozen1);
+        grainPool.retireFinished(segmentTime + numSamples);
+        spectralGrains.retireFinished(segmentTime + numSamples);
+        
+        //blend the dry voice under the grains
+        for (int c = 0; c < segment.getNumChannels(); c++)
+            juce::FloatVectorOperations::multiply(segment.getWritePointer(c), b, numSamples);
+        if (live){
+            capture.addRecentTo(segment, segmentTime, (SampleType) 1 - b);
+        }else if (noteOn){
+            dryVoice.addTo(segment, 0, numSamples, currentBuffer, *reverse ? -rate : rate, (SampleType) 1 - b);
         }else{
-            currentPos =  (*position) * (float)numSamplesInFile;
+            dryVoice.setPosition((*position) * numSamplesInFile);
         }
-        
-        
-        time++;
+        if (fadeLeft > 0) addOutgoing(segment, segmentTime);
+        segmentStart = segmentEnd;
     }
+    //events stamped past the end of the block take effect from the next one
+    for (; event != midiMessages.cend(); ++event)
+        handleMidiEvent((*event).getMessage(), blockEnd, params);
+    publishGrainSnapshot(snapshot.numEntries);
+    
+    //clip, one pass per channel
+    for (int c = 0; c < buffer.getNumChannels(); c++){
+        SampleType* channelData = buffer.getWritePointer(c);
+        juce::FloatVectorOperations::clip(channelData, channelData, (SampleType) -1, (SampleType) 1, numSamplesInBlock);
+    }
+    time = blockEnd;
     // This is the place where you'd normally do the guts of your plugin's
     // audio processing...
     // Make sure to reset the state if your inner loop is processing
@@ -258,46 +483,627 @@ void CranulatorAudioProcessor::processBlock (juce::AudioBuffer<float>& buffer, j
     // interleaved by keeping the same state.
 }
 
-void CranulatorAudioProcessor::processMidi (juce::MidiBuffer& midiMessage, int numSamples){
-    juce::MidiMessage m;
-    for(auto meta : midiMessage){
-        m = meta.getMessage();
-        if(m.isNoteOn()){
-            midiNotes[m.getNoteNumber()] = m.getVelocity();
-            noteOn = true;
+void CranulatorAudioProcessor::processBlock (juce::AudioBuffer<float>& buffer, juce::MidiBuffer& midiMessages)
+{
+    const juce::AudioProcessLoadMeasurer::ScopedTimer timer (loadMeasurer, buffer.getNumSamples());
+    processBlockInternal(buffer, midiMessages);
+    addPreview(buffer);
+}
+
+void CranulatorAudioProcessor::processBlock (juce::AudioBuffer<double>& buffer, juce::MidiBuffer& midiMessages)
+{
+    //the host hands us its 64-bit buffer directly, the engine runs on the double copy of the file
+    const juce::AudioProcessLoadMeasurer::ScopedTimer timer (loadMeasurer, buffer.getNumSamples());
+    processBlockInternal(buffer, midiMessages);
+    addPreview(buffer);
+}
+
+template <typename SampleType>
+void CranulatorAudioProcessor::addPreview (juce::AudioBuffer<SampleType>& buffer){
+    //a new preview, or none, restarts from the top; the old buffer stays in `buffers`, so dropping it here frees nothing
+    {
+        const juce::SpinLock::ScopedTryLockType tl(previewLock);
+        if (tl.isLocked() && publishedPreviewId != previewPlaying){
+            previewPlaying = publishedPreviewId;
+            previewBuffer = publishedPreview.buffer;
+            audioPreview = previewBuffer.get();
             notify();
+            previewStep = fs > 0 && publishedPreview.sampleRate > 0 ? publishedPreview.sampleRate / fs : 1.0;
+            previewLeft = previewBuffer != nullptr ? (juce::int64) (previewBuffer->getNumSamples() / previewStep) : 0;
+            previewVoice.setPosition(0);
+        }
+    }
+    if (previewBuffer == nullptr || previewLeft <= 0 || !previewBuffer->isReadyFor<SampleType>()) return;
+    const int n = (int) juce::jmin((juce::int64) buffer.getNumSamples(), previewLeft);
+    previewVoice.addTo(buffer, 0, n, *previewBuffer, previewStep, (SampleType) 0.5);
+    previewLeft -= n;
+}
+
+template <typename SampleType>
+void CranulatorAudioProcessor::processIdle (juce::AudioBuffer<SampleType>& buffer, int numSamplesInFile, bool live){
+    //same blend and clip as the full loop, with no grains and no dry voice to add
+    //in live mode the input is the dry signal, so it passes at the dry gain
+    const int numSamples = buffer.getNumSamples();
+    const SampleType b = live ? (SampleType) 1 - (SampleType) *blend : (SampleType) *blend;
+    for (int c = 0; c < buffer.getNumChannels(); c++){
+        SampleType* channelData = buffer.getWritePointer(c);
+        juce::FloatVectorOperations::multiply(channelData, b, numSamples);
+        juce::FloatVectorOperations::clip(channelData, channelData, (SampleType) -1, (SampleType) 1, numSamples);
+    }
+    dryVoice.setPosition((*position) * numSamplesInFile);
+    time += numSamples;
+    grainSnapshots.getWriteBuffer().numEntries = 0;
+    publishGrainSnapshot(0);
+}
+
+template <typename SampleType>
+void CranulatorAudioProcessor::addOutgoing (juce::AudioBuffer<SampleType>& segment, long long int segmentTime){
+    //the previous preset's grains and dry voice, blended as they were and added under a falling ramp
+    juce::AudioBuffer<SampleType>& scratch = freezeCache.getScratch<SampleType>();
+    if (outgoingBuffer == nullptr || !outgoingBuffer->isReadyFor<SampleType>() || scratch.getNumSamples() == 0){
+        endPresetFade();
+        return;
+    }
+    const ReferenceCountedBuffer& source = *outgoingBuffer;
+    const bool spectralOut = outgoingFrames != nullptr && outgoingFrames->getSource() == &source;
+    const int total = juce::jmin(segment.getNumSamples(), fadeLeft);
+    for (int done = 0; done < total; ){
+        const int n = juce::jmin(total - done, scratch.getNumSamples());
+        juce::AudioBuffer<SampleType> part (scratch.getArrayOfWritePointers(), segment.getNumChannels(), 0, n);
+        part.clear();
+        outgoingFilters.render(outgoingPool, part, source, segmentTime + done);
+        if (spectralOut) outgoingSpectral.render(*outgoingFrames, part, segmentTime + done);
+        for (int c = 0; c < part.getNumChannels(); c++)
+            juce::FloatVectorOperations::multiply(part.getWritePointer(c), (SampleType) outgoingBlend, n);
+        if (outgoingDryOn) outgoingDry.addTo(part, 0, n, source, outgoingStep, (SampleType) (1 - outgoingBlend));
+        const float g0 = (float) fadeLeft / fadeLength;
+        const float g1 = (float) (fadeLeft - n) / fadeLength;
+        for (int c = 0; c < segment.getNumChannels(); c++)
+            segment.addFromWithRamp(c, done, part.getReadPointer(c), n, (SampleType) g0, (SampleType) g1);
+        fadeLeft -= n;
+        done += n;
+    }
+    outgoingPool.retireFinished(segmentTime + total);
+    outgoingSpectral.retireFinished(segmentTime + total);
+    if (fadeLeft == 0) endPresetFade();
+}
+
+void CranulatorAudioProcessor::takePresetSwitch(){
+    //a switch during a fade waits for it to end, so no more than two clouds ever sound
+    if (fadeLeft > 0) return;
+    const juce::SpinLock::ScopedTryLockType tl(switchLock);
+    if (!tl.isLocked() || publishedSwitchId == switchPlaying) return;
+    switchPlaying = publishedSwitchId;
+    
+    //the cloud moves aside whole, slots and filter state included, and keeps reading the file it was reading
+    outgoingBuffer = *liveInput ? capture.getRing() : fileBuffer;
+    if (outgoingBuffer != nullptr){
+        grainPool.swap(outgoingPool);
+        grainFilters.swap(outgoingFilters);
+        spectralGrains.swap(outgoingSpectral);
+        outgoingFrames = spectrum;
+        outgoingDry = dryVoice;
+        outgoingStep = *reverse ? -rate : rate;
+        outgoingBlend = *blend;
+        outgoingDryOn = noteOn && !*liveInput;
+        fadeLength = fadeLeft = juce::jmax(1, (int) (presetFadeSeconds * fs));
+    }
+    
+    //setValue only stores the value; the host and the listeners hear about it from the scheduler, never from this thread
+    const juce::Array<juce::AudioProcessorParameter*>& parameters = getParameters();
+    bool anyChanged = false;
+    for (int i = 0; i < juce::jmin(parameters.size(), (int) publishedSwitch.values.size()); i++){
+        juce::AudioProcessorParameter* p = parameters.getUnchecked(i);
+        if (p->getValue() == publishedSwitch.values[(size_t) i]) continue;
+        p->setValue(publishedSwitch.values[(size_t) i]);
+        anyChanged = true;
+    }
+    if (anyChanged) ++switchesTaken;
+    //the only place fileBuffer is written; the old file stays in `buffers`, so dropping it here frees nothing
+    if (publishedSwitch.buffer != nullptr) fileBuffer = publishedSwitch.buffer;
+    if (fileBuffer != nullptr) dryVoice.setPosition((*position) * fileBuffer->getNumSamples());
+    audioOutgoing = outgoingBuffer.get();
+    audioFile = fileBuffer.get();
+    notify();
+}
+
+void CranulatorAudioProcessor::endPresetFade(){
+    fadeLeft = 0;
+    outgoingPool.clear();
+    outgoingSpectral.clear();
+    outgoingFrames = nullptr;
+    if (outgoingBuffer == nullptr) return;
+    //dropped before it is cleared, so the scheduler never frees a file this thread still holds
+    outgoingBuffer = nullptr;
+    audioOutgoing = nullptr;
+    notify();
+}
+
+void CranulatorAudioProcessor::publishGrainSnapshot (int numEntries){
+    //an empty cloud is only worth handing over once, so an idle editor is not woken every block
+    if (numEntries == 0 && lastSnapshotSize == 0) return;
+    grainSnapshots.publish();
+    lastSnapshotSize = numEntries;
+}
+
+void CranulatorAudioProcessor::handleMidiEvent (const juce::MidiMessage& m, long long int when, const GrainParams& params){
+    //a note's first grain starts exactly where the note does
+    const int tailSamples = (int) (params.tail * fs);
+    if (m.isNoteOnOrOff() || m.isAllNotesOff() || m.isAllSoundOff()){
+        //any change of notes ends a freeze on the spot, the new grains must be heard
+        ++noteGeneration;
+        freezeCache.invalidate();
+    }
+    if(m.isNoteOn()){
+        GrainVoice& voice = GrainVoice::allocate(voices, GrainVoice::maxVoices, m.getNoteNumber());
+        voice.start(m.getNoteNumber(), m.getFloatVelocity(), when, random.nextInt64());
+        voice.params = params;
+    }else if(m.isNoteOff()){
+        for (GrainVoice& voice : voices){
+            if (voice.note == m.getNoteNumber()) voice.release(when, tailSamples);
+        }
+    }else if(m.isAllNotesOff() || m.isAllSoundOff()){
+        for (GrainVoice& voice : voices) voice.release(when, tailSamples);
+    }else if(m.isProgramChange()){
+        setCurrentProgram(m.getProgramChangeNumber());
+    }
+}
+
+GrainParams CranulatorAudioProcessor::readParams() const{
+    GrainParams p;
+    p.position = *position;
+    p.randPos = *randPos;
+    p.duration = *duration;
+    p.randDur = *randDur;
+    p.volume = *volume;
+    p.randGain = *randGain;
+    p.density = *density;
+    p.randDens = *randDens;
+    p.reverse = *reverse;
+    p.randRev = *randRev;
+    p.randPitch = *randPitch;
+    p.transpose = *transpose;
+    p.envAttack = *envAttack;
+    p.envRelease = *envRelease;
+    p.envCurve = *envCurve;
+    p.cullThreshold = juce::Decibels::decibelsToGain(cullLevel->get(), -120.0f);
+    p.pan = *pan;
+    p.spread = *spread;
+    p.width = *width;
+    p.filterMode = filterMode->getIndex();
+    p.cutoff = *cutoff;
+    p.resonance = *resonance;
+    p.randCutoff = *randCutoff;
+    p.spectral = *spectral;
+    p.placement = placement->getIndex();
+    p.pitchSync = *pitchSync;
+    //a bounce can afford a better tier than playback
+    p.interpolation = (isNonRealtime() ? offlineInterpolation : interpolation)->getIndex();
+    p.live = *liveInput;
+    p.tail = *releaseTail;
+    return p;
+}
+
+ModMatrix::Settings CranulatorAudioProcessor::readModSettings() const{
+    ModMatrix::Settings s;
+    for (int l = 0; l < ModMatrix::numLfos; l++){
+        s.lfo[l].rate = *lfoRate[l];
+        s.lfo[l].shape = lfoShape[l]->getIndex();
+    }
+    s.randomRate = *randomRate;
+    s.envAttack = *modEnvAttack;
+    s.envDecay = *modEnvDecay;
+    s.envSustain = *modEnvSustain;
+    for (int i = 0; i < ModMatrix::numSlots; i++){
+        s.slot[i].source = modSource[i]->getIndex();
+        s.slot[i].destination = modDestination[i]->getIndex();
+        s.slot[i].depth = *modDepth[i];
+    }
+    return s;
+}
+
+void CranulatorAudioProcessor::spawnGrains (GrainVoice& voice, const ReferenceCountedBuffer& source, int outChannels, long long int until,
+                                             GrainPool& pool, const ModMatrix& mods, const SpeakerLayout& layout, const SourceIndex* index,
+                                             SpectralGrains* spectralPool){
+    //every grain whose onset comes before `until` is built now, on the audio thread or in the freeze render
+    const int numSamples = source.getNumSamples();
+    while (voice.nextOnset < until){
+        const long long int onset = voice.nextOnset;
+        voice.updateState(onset);
+        if (voice.state == GrainVoice::State::free) return;
+        //modulation is sampled once per grain, at its onset
+        GrainParams p = voice.params;
+        mods.apply(p, onset, voice);
+        
+        float midiNote = voice.note - 60 + p.transpose;
+        float r = pow (2.0, midiNote / binsPerOctave);
+        r *= 0.5 * (0.5 - voice.random.nextFloat()) * p.randPitch + 1;
+        //Duration
+        float dur = p.duration;
+        dur *= 1 + 0.1 * voice.random.nextFloat() * p.randDur;
+        int length = dur * fs;
+        //Density
+        float dens = p.density;
+        dens *= 1 + (0.5 - voice.random.nextFloat()) * p.randDens;
+        
+        bool R = p.reverse;
+        if (0.5 * (p.randRev + 1.0f) * voice.random.nextFloat() > 0.5){
+            R = !R;
+        }
+        
+        //Position
+        float pos = p.position + p.randPos * (voice.random.nextFloat() - 0.5);
+        int startPos;
+        //live positions count back from the write head, 1 being the newest audio
+        if (p.live) startPos = capture.startPosition(onset, pos, length, r, R);
+        else{
+            startPos = wrap2int(pos * numSamples, 0, numSamples);
+            //out of silence or onto the next onset, one lookup in the file's index
+            if (index != nullptr) startPos = index->place(startPos, p.placement);
+        }
+        
+        //Amplitude, scaled by the note's velocity and by how far into its tail a released note is
+        float amp = p.volume;
+        amp *= 1 - voice.random.nextFloat() * p.randGain;
+        amp *= voice.velocity * voice.level(onset);
+        voice.nextOnset = onset + juce::jmax((long long int) 1, (long long int) (dens * dur * fs));
+        //Pitch sync: two periods around the nearest pitch mark, read at the file's own speed so the formants stay put.
+        //The note's pitch comes from laying one grain down every period / ratio instead
+        float attack = p.envAttack, release = p.envRelease;
+        bool synced = false;
+        if (p.pitchSync && index != nullptr && !p.live){
+            const float period = index->periodAt(startPos);
+            const int mark = period > 0 ? index->nearestMark(startPos) : -1;
+            if (mark >= 0 && std::abs(mark - startPos) <= period){
+                const int twoPeriods = juce::jmax(2, (int) (2.0f * period));
+                startPos = wrap2int(R ? mark + twoPeriods / 2 : mark - twoPeriods / 2, 0, numSamples);
+                length = twoPeriods;
+                attack = release = 0.5f;
+                //overlapping windows add up, so a raised pitch would otherwise get louder
+                amp *= juce::jmin(1.0f, 1.0f / r);
+                voice.nextOnset = onset + juce::jmax((long long int) 1, (long long int) (period / r));
+                r = 1.0f;
+                synced = true;
+            }
+        }
+        
+        //Pan, worked out once here so rendering is a gain per route
+        const float azimuth = juce::MathConstants<float>::halfPi * p.pan
+                            + juce::MathConstants<float>::pi * p.spread * 2.0f * (voice.random.nextFloat() - 0.5f);
+        const SpatialRoutes routes = layout.routesFor(azimuth, p.width, source.getNumChannels());
+        //Filter, the cutoff scattered up to two octaves either way; no draw when it is off, so the other randoms stay put
+        GrainFilter filter;
+        if (p.filterMode != GrainFilter::off){
+            const float fc = p.cutoff * std::exp2(4.0f * (voice.random.nextFloat() - 0.5f) * p.randCutoff);
+            filter = GrainFilter::make(p.filterMode, fc, p.resonance, fs);
         }
-        if(m.isNoteOff()) {
-            midiNotes[m.getNoteNumber()] = 0;
+        //grains under the cull level still take their slot in time, a full pool drops the grain
+        if (spectralPool != nullptr && p.spectral && !synced)
+            spectralPool->spawn(onset, length, startPos, attack, release, p.envCurve, r, amp, R, p.cullThreshold,
+                                source.getNumChannels(), outChannels, source.getStorage(), routes);
+        else
+            pool.spawn(onset, length, startPos, attack, release, p.envCurve, r, amp, R, p.cullThreshold,
+                                source.getNumChannels(), outChannels, source.getStorage(), routes, filter, (CircularRead::Interpolation) p.interpolation);
+    }
+    voice.updateState(until);
+}
+
+void CranulatorAudioProcessor::renderFrozenCloud (FreezeRequest& request){
+    //plays the voices forward from where the audio thread left them, the warm-up lets the cloud fill before the loop starts
+    const int numChannels = request.numChannels;
+    const int total = request.warmUp + request.loopLength + request.fadeLength;
+    if (request.source == nullptr || request.loopLength <= 0) return;
+    const ReferenceCountedBuffer& source = *request.source;
+    juce::AudioBuffer<float> rendered (numChannels, total);
+    rendered.clear();
+    freezePool.clear();
+    constexpr int chunk = 512;
+    for (int done = 0; done < total; done += chunk){
+        //the cloud moved on while this was rendering
+        if (request.generation != freezeCache.getGeneration()) return;
+        const int n = juce::jmin(chunk, total - done);
+        const long long int t = request.start + done;
+        freezeMods.process(t, n, request.mods);
+        for (GrainVoice& voice : request.voices){
+            if (voice.state != GrainVoice::State::free) spawnGrains(voice, source, numChannels, t + n, freezePool, freezeMods, request.layout, request.index.get());
         }
-//        if(m.isAllNotesOff()){
-//            for(int i = 0; i < 128; i++)    midiNotes[i] = 0;
-//        }
+        juce::AudioBuffer<float> part (rendered.getArrayOfWritePointers(), numChannels, done, n);
+        freezeFilters.render(freezePool, part, source, t);
+        freezePool.retireFinished(t + n);
     }
+    freezePool.clear();
+    freezeCache.publish(new FrozenCloud(rendered, request.warmUp, request.loopLength, request.fadeLength,
+                                        request.start + request.warmUp, request.generation));
 }
 bool CranulatorAudioProcessor::checkRestorePath(){
-    if(restorePath.isEmpty()) return false;
-    juce::File f(restorePath);
+    juce::String path;
+    {
+        const juce::ScopedLock sl(pathLock);
+        if(restorePath.isEmpty()) return false;
+        path = restorePath;
+    }
+    juce::File f(path);
     if(f.exists()){
-        loadFile(restorePath);
-        restorePath = "";
+        loadFile(path);
+        const juce::ScopedLock sl(pathLock);
+        if (restorePath == path) restorePath = "";
         return true;
     }
     return false;
 }
+void CranulatorAudioProcessor::requestLoad (const juce::String & path){
+    {
+        const juce::ScopedLock sl(pathLock);
+        restorePath = path;
+    }
+    notify();
+}
+void CranulatorAudioProcessor::freeUnusedBuffers(){
+    //a file goes once the audio thread neither holds it nor can take it. The decode cache, the warm presets
+    //and other instances may still hold it, so the reference count says nothing, but none of them drops it
+    //on this instance's audio thread. The files dropped are freed after the locks, here.
+    juce::ReferenceCountedArray<ReferenceCountedBuffer> unused;
+    {
+        const juce::SpinLock::ScopedLockType switchHeld(switchLock);
+        const juce::SpinLock::ScopedLockType previewHeld(previewLock);
+        for (int i = buffers.size() - 1; i >= 0; i--){
+            ReferenceCountedBuffer* b = buffers.getUnchecked(i);
+            if (b == audioFile.load() || b == audioOutgoing.load() || b == audioPreview.load()
+                || b == publishedSwitch.buffer.get() || b == publishedPreview.buffer.get()) continue;
+            unused.add(b);
+            buffers.remove(i);
+        }
+    }
+}
+void CranulatorAudioProcessor::prepareHeldBuffers(){
+    if (!precisionWanted.exchange(false) || !isUsingDoublePrecision()) return;
+    for (int i = 0; i < buffers.size(); i++) buffers.getUnchecked(i)->prepareDoublePrecision();
+    const juce::ScopedLock sl(warmLock);
+    for (const WarmSource& w : warmSources) w.decoded.buffer->prepareDoublePrecision();
+}
+void CranulatorAudioProcessor::freeUnusedIndexes(){
+    //the same for indexes: a warm preset keeps its index, which once played stays referenced after the audio thread lets go
+    juce::ReferenceCountedArray<SourceIndex> unused;
+    {
+        const juce::SpinLock::ScopedLockType sl(indexLock);
+        for (int i = indexes.size() - 1; i >= 0; i--){
+            SourceIndex* index = indexes.getUnchecked(i);
+            if (index == audioIndex.load() || index == publishedIndex.get()) continue;
+            unused.add(index);
+            indexes.remove(i);
+        }
+    }
+}
 
 void CranulatorAudioProcessor::loadFile (const juce::String & path){
     juce::File fileToPlay(path);
     DBG(path);
-    juce::AudioFormatReader* reader = formatManager.createReaderFor(fileToPlay);
-    juce::ReferenceCountedObjectPtr<ReferenceCountedBuffer> newBuffer =
-    new ReferenceCountedBuffer(fileToPlay.getFileName(), reader->numChannels,reader->lengthInSamples);
-    reader->read(newBuffer->get(), 0, reader->lengthInSamples, 0, true, true); //buffer, startsample in destbuff,numsmple,reader start,useleft,use right
-    std::cout << "Read Buffer: " << reader->lengthInSamples << " Samples!\n";
-    fileBuffer = newBuffer;
-    std::cout << fileBuffer.get() << std::endl;
-    filePath = path;
-    delete reader;
+    //a file previewed in the browser, or loaded by another instance, is already decoded
+    const DecodeCache::Decoded decoded = decodeCache->get(fileToPlay, sampleStorage);
+    if (decoded.buffer == nullptr) return;
+    juce::ReferenceCountedObjectPtr<ReferenceCountedBuffer> newBuffer = decoded.buffer;
+    if (isUsingDoublePrecision()) newBuffer->prepareDoublePrecision();
+    buffers.addIfNotAlreadyThere(newBuffer.get());
+    //a load is a switch that keeps the knobs, so it takes the same handoff and fade as a preset
+    loadedBuffer = newBuffer;
+    PresetSwitch next;
+    next.buffer = newBuffer;
+    publishSwitch(next);
+    buildOverview(newBuffer);
+    spectrumBuiltFor = nullptr;
+    if (*spectral) buildSpectrum(newBuffer);
+    buildIndex(newBuffer, decoded.sampleRate, fileToPlay);
+    const SampleArena::Stats stats = sampleArena->getStats();
+    juce::Logger::writeToLog("Sample memory: " + juce::String(stats.bytesMapped >> 20) + " MB mapped, "
+                             + juce::String(stats.bytesLocked >> 20) + " MB locked, "
+                             + juce::String(stats.bytesUnlocked >> 20) + " MB unlocked, "
+                             + juce::String(stats.hugePageBytes >> 20) + " MB huge pages, "
+                             + juce::String(stats.lockFailures) + " lock failures");
+    setFilePath(path);
+    notify();
+}
+bool CranulatorAudioProcessor::canLoad (const juce::String& path) const{
+    const juce::File file (path);
+    return file.existsAsFile() && formatManager.findFormatForFileExtension(file.getFileExtension()) != nullptr;
+}
+void CranulatorAudioProcessor::requestPreview (const juce::String& path){
+    {
+        const juce::ScopedLock sl(pathLock);
+        previewPath = path;
+    }
+    notify();
+}
+void CranulatorAudioProcessor::stopPreview(){
+    const juce::SpinLock::ScopedLockType sl(previewLock);
+    publishedPreview = {};
+    ++publishedPreviewId;
+}
+void CranulatorAudioProcessor::checkPreviewPath(){
+    juce::String path;
+    {
+        const juce::ScopedLock sl(pathLock);
+        std::swap(path, previewPath);
+    }
+    if (path.isEmpty()) return;
+    DecodeCache::Decoded decoded = decodeCache->get(juce::File(path), sampleStorage);
+    if (decoded.buffer == nullptr) return;
+    if (isUsingDoublePrecision()) decoded.buffer->prepareDoublePrecision();
+    buffers.addIfNotAlreadyThere(decoded.buffer.get());
+    const juce::SpinLock::ScopedLockType sl(previewLock);
+    publishedPreview = decoded;
+    ++publishedPreviewId;
+}
+void CranulatorAudioProcessor::buildOverview (ReferenceCountedBuffer::Ptr buffer){
+    const int generation = ++overviewGeneration;
+    {
+        const juce::SpinLock::ScopedLockType sl(overviewLock);
+        overview = nullptr;
+    }
+    overviewChanged.sendChangeMessage();
+    analysisQueue.add([this, buffer, generation]{
+        PeakPyramid::Ptr pyramid = new PeakPyramid(*buffer);
+        //a newer file may have been loaded while this one was scanned
+        if (generation != overviewGeneration.load()) return;
+        {
+            const juce::SpinLock::ScopedLockType sl(overviewLock);
+            overview = pyramid;
+        }
+        overviewChanged.sendChangeMessage();
+    });
+}
+void CranulatorAudioProcessor::buildSpectrum (ReferenceCountedBuffer::Ptr buffer){
+    if (buffer == nullptr || buffer.get() == spectrumBuiltFor) return;
+    spectrumBuiltFor = buffer.get();
+    const int generation = ++spectrumGeneration;
+    //the grains stay in the time domain for this file
+    if (SpectralFrames::bytesFor(*buffer) > SpectralFrames::maxBytes){
+        juce::Logger::writeToLog("Spectral mode: file too long, needs " + juce::String(SpectralFrames::bytesFor(*buffer) >> 20) + " MB of frames");
+        return;
+    }
+    analysisQueue.add([this, buffer, generation]{
+        //a newer file drops this one, and so does shutting down
+        juce::ThreadPoolJob* job = juce::ThreadPoolJob::getCurrentThreadPoolJob();
+        SpectralFrames::Ptr frames = SpectralFrames::build(buffer, analysisQueue.getParallelPool(), [this, job, generation]{
+            return generation != spectrumGeneration.load() || (job != nullptr && job->shouldExit());
+        });
+        if (frames == nullptr || generation != spectrumGeneration.load()) return;
+        spectra.add(frames.get());
+        const juce::SpinLock::ScopedLockType sl(spectrumLock);
+        publishedSpectrum = frames;
+    });
+}
+void CranulatorAudioProcessor::buildIndex (ReferenceCountedBuffer::Ptr buffer, double fileSampleRate, const juce::File& audioFile){
+    const int generation = ++indexGeneration;
+    analysisQueue.add([this, buffer, fileSampleRate, audioFile, generation]{
+        juce::ThreadPoolJob* job = juce::ThreadPoolJob::getCurrentThreadPoolJob();
+        SourceIndex::Ptr index = SourceIndex::build(buffer, fileSampleRate, audioFile, analysisQueue.getParallelPool(), [this, job, generation]{
+            return generation != indexGeneration.load() || (job != nullptr && job->shouldExit());
+        });
+        if (index == nullptr || generation != indexGeneration.load()) return;
+        //added and published in one go, so the scheduler never sees it held by neither
+        const juce::SpinLock::ScopedLockType sl(indexLock);
+        indexes.add(index.get());
+        publishedIndex = index;
+    });
+}
+void CranulatorAudioProcessor::storePreset (int index, const juce::String& name){
+    PresetBank::Preset preset;
+    preset.name = name;
+    preset.path = getFilePath();
+    for (juce::AudioProcessorParameter* p : getParameters()){
+        if (juce::AudioProcessorParameterWithID* withID = dynamic_cast<juce::AudioProcessorParameterWithID*> (p))
+            preset.values.emplace_back(withID->paramID, p->getValue());
+    }
+    presets.set(index, preset);
+    updateHostDisplay();
+    warmPresets(currentPreset.load());
+}
+void CranulatorAudioProcessor::checkPresetSwitch(){
+    const int index = wantedPreset.exchange(-1);
+    if (index < 0) return;
+    const PresetBank::Preset preset = presets.get(index);
+    warmPresets(index);
+    if (preset.isEmpty()) return;
+    
+    //parameters the preset predates go to their defaults, so a preset always sounds the same
+    PresetSwitch next;
+    for (juce::AudioProcessorParameter* p : getParameters()){
+        juce::AudioProcessorParameterWithID* withID = dynamic_cast<juce::AudioProcessorParameterWithID*> (p);
+        next.values.push_back(withID != nullptr ? preset.get(withID->paramID, p->getDefaultValue()) : p->getValue());
+    }
+    if (preset.path.isNotEmpty() && preset.path != getFilePath()){
+        //a warm neighbour is ready to go, anything else is decoded here like a load
+        WarmSource source = findWarm(preset.path, sampleStorage);
+        const bool warm = source.decoded.buffer != nullptr;
+        if (!warm) source.decoded = decodeCache->get(juce::File(preset.path), sampleStorage);
+        if (ReferenceCountedBuffer::Ptr buffer = source.decoded.buffer){
+            if (isUsingDoublePrecision()) buffer->prepareDoublePrecision();
+            buffers.addIfNotAlreadyThere(buffer.get());
+            loadedBuffer = buffer;
+            next.buffer = buffer;
+            buildOverview(buffer);
+            spectrumBuiltFor = nullptr;
+            if (preset.get(spectral->paramID, 0.0f) >= 0.5f) buildSpectrum(buffer);
+            //the audio thread only takes the index once it plays this buffer
+            if (source.index != nullptr){
+                ++indexGeneration;
+                const juce::SpinLock::ScopedLockType sl(indexLock);
+                indexes.addIfNotAlreadyThere(source.index.get());
+                publishedIndex = source.index;
+            }else{
+                buildIndex(buffer, source.decoded.sampleRate, juce::File(preset.path));
+            }
+            setFilePath(preset.path);
+        }
+    }
+    publishSwitch(next);
+}
+void CranulatorAudioProcessor::announceSwitch(){
+    const int taken = switchesTaken.load();
+    if (taken == switchesAnnounced) return;
+    switchesAnnounced = taken;
+    //only the listeners are called, so a knob the user moves meanwhile is never set back to what the switch left
+    for (juce::AudioProcessorParameter* p : getParameters()) p->sendValueChangedMessageToListeners(p->getValue());
+    updateHostDisplay();
+}
+void CranulatorAudioProcessor::publishSwitch (PresetSwitch next){
+    const juce::SpinLock::ScopedLockType sl(switchLock);
+    //a switch the audio thread has not taken yet is merged, so a load right after a preset keeps its knobs and the other way round
+    if (publishedSwitchId != switchPlaying){
+        if (next.values.empty()) std::swap(next.values, publishedSwitch.values);
+        if (next.buffer == nullptr) std::swap(next.buffer, publishedSwitch.buffer);
+    }
+    //the replaced switch goes out with `next`, freed here and not on the audio thread
+    std::swap(publishedSwitch, next);
+    ++publishedSwitchId;
+}
+void CranulatorAudioProcessor::warmPresets (int index){
+    //the current preset and the ones either side, so stepping back and forth never waits on a decode
+    juce::StringArray paths;
+    for (int i = index - 1; i <= index + 1; i++){
+        const juce::String path = presets.get(i).path;
+        if (path.isNotEmpty() && !paths.contains(path)) paths.add(path);
+    }
+    const int generation = ++warmGeneration;
+    const SampleStorage storage = sampleStorage;
+    warmingQueue.add([this, paths, generation, storage]{
+        juce::ThreadPoolJob* job = juce::ThreadPoolJob::getCurrentThreadPoolJob();
+        const auto cancelled = [this, job, generation]{
+            return generation != warmGeneration.load() || (job != nullptr && job->shouldExit());
+        };
+        std::vector<WarmSource> next;
+        for (const juce::String& path : paths){
+            if (cancelled()) return;
+            WarmSource w = findWarm(path, storage);
+            if (w.decoded.buffer == nullptr){
+                w.path = path;
+                w.storage = storage;
+                w.decoded = decodeCache->get(juce::File(path), storage);
+                if (w.decoded.buffer == nullptr) continue;
+                w.index = SourceIndex::build(w.decoded.buffer, w.decoded.sampleRate, juce::File(path), warmingQueue.getParallelPool(), cancelled);
+            }
+            //the precision is read now, not when the job was queued: state is often restored before prepareToPlay
+            if (isUsingDoublePrecision()) w.decoded.buffer->prepareDoublePrecision();
+            next.push_back(w);
+        }
+        if (cancelled()) return;
+        //the sources that dropped out are freed after the lock, on this thread
+        const juce::ScopedLock sl(warmLock);
+        std::swap(warmSources, next);
+    });
+}
+CranulatorAudioProcessor::WarmSource CranulatorAudioProcessor::findWarm (const juce::String& path, SampleStorage storage) const{
+    const juce::ScopedLock sl(warmLock);
+    for (const WarmSource& w : warmSources){
+        if (w.path == path && w.storage == storage) return w;
+    }
+    return {};
+}
+void CranulatorAudioProcessor::setSampleStorage (SampleStorage newStorage){
+    if (newStorage == sampleStorage) return;
+    sampleStorage = newStorage;
+    const juce::String path = getFilePath();
+    if (path.isNotEmpty()) requestLoad(path);
 }
 //==============================================================================
 bool CranulatorAudioProcessor::hasEditor() const
@@ -317,21 +1123,47 @@ void CranulatorAudioProcessor::getStateInformation (juce::MemoryBlock& destData)
     // You should use this method to store your parameters in the memory block.
     // You could do that either as raw data, or use the XML or ValueTree classes
     // as intermediaries to make it easy to save and load complex data.
-    juce::XmlElement xml("CranulatorSettings");
-    for (int i = 0; i < getNumParameters(); i++){
-        if (juce::AudioProcessorParameterWithID* p = dynamic_cast<juce::AudioProcessorParameterWithID*> (getParameters().getUnchecked(i)))
-        {
-            xml.setAttribute (p->paramID, p->getValue());
-        }
-        xml.setAttribute ("restorePath", filePath);
-        copyXmlToBinary (xml, destData);
+    //the live knobs and file are written as one more preset, ahead of the bank
+    PresetBank::Preset current;
+    current.path = getFilePath();
+    for (juce::AudioProcessorParameter* p : getParameters()){
+        if (juce::AudioProcessorParameterWithID* withID = dynamic_cast<juce::AudioProcessorParameterWithID*> (p))
+            current.values.emplace_back(withID->paramID, p->getValue());
     }
+    destData.reset();
+    juce::MemoryOutputStream out (destData, false);
+    out.writeInt(stateMagic);
+    out.writeInt(stateVersion);
+    out.writeCompressedInt((int) sampleStorage);
+    out.writeCompressedInt(currentPreset.load());
+    current.write(out);
+    presets.write(out);
+    out.flush();
 }
 
 void CranulatorAudioProcessor::setStateInformation (const void* data, int sizeInBytes)
 {
     // You should use this method to restore your parameters from this memory block,
     // whose contents will have been created by the getStateInformation() call.
+    juce::MemoryInputStream in (data, (size_t) juce::jmax(0, sizeInBytes), false);
+    if (sizeInBytes >= 8 && in.readInt() == stateMagic){
+        if (in.readInt() != stateVersion) return;
+        const int storage = in.readCompressedInt();
+        const int program = in.readCompressedInt();
+        PresetBank::Preset current;
+        if (!current.read(in) || !presets.read(in)) return;
+        for (juce::AudioProcessorParameter* p : getParameters()){
+            if (juce::AudioProcessorParameterWithID* withID = dynamic_cast<juce::AudioProcessorParameterWithID*> (p))
+                p->setValueNotifyingHost(current.get(withID->paramID, p->getValue()));
+        }
+        sampleStorage = (SampleStorage) juce::jlimit(0, 2, storage);
+        currentPreset = juce::jlimit(0, PresetBank::numSlots - 1, program);
+        requestLoad(current.path);
+        warmPresets(currentPreset.load());
+        updateHostDisplay();
+        return;
+    }
+    //sessions saved before the preset bank hold one XML element
     auto xmlState = (getXmlFromBinary (data, sizeInBytes));
     if (xmlState != nullptr){
         if (xmlState->hasTagName ("CranulatorSettings")){
@@ -343,79 +1175,31 @@ void CranulatorAudioProcessor::setStateInformation (const void* data, int sizeIn
                     
                 }
             }
-            restorePath = xmlState->getStringAttribute("restorePath");
+            sampleStorage = (SampleStorage) juce::jlimit(0, 2, xmlState->getIntAttribute("storage", 0));
+            requestLoad(xmlState->getStringAttribute("restorePath"));
         }
     }
 }
 
 void CranulatorAudioProcessor::run(){
-    
+    //grains are scheduled on the audio thread, this one only loads files and frees old ones
     while (! threadShouldExit()){
         checkRestorePath();
-        
-        if(grains.size() > 0){
-            for (int i = grains.size() - 1; i >= 0; i--){
-                long long int grainEnd = grains[i].onset + grains[i].grainLengthInSample;
-                if(grainEnd < time) grains.remove(i);
-            }
-        }
-        
-        juce::Array<juce::Array<int>> activeNotes;
-        
-        for(int i = 0; i < 128; i++){
-            if(midiNotes[i] > 0){
-                activeNotes.add(juce::Array<int> {i, midiNotes[i]} );
-            }
-        }
-        //add to grains
-        if (fileBuffer != nullptr){
-            if(activeNotes.size() > 0){
-                if (nextGrainOnset == 0) nextGrainOnset = time;
-                
-                int numSamples = fileBuffer->get()->getNumSamples();
-                float midiNote = 60;
-                midiNote = activeNotes[juce::Random::getSystemRandom().nextInt(activeNotes.size())][0] - 60 + (*transpose);
-                float r = pow (2.0, midiNote / binsPerOctave);
-                r *= 0.5 * (0.5 - juce::Random::getSystemRandom().nextFloat()) * (*randPitch) + 1;
-                //Duration
-                float dur = *duration;
-                dur *= 1 + 0.1 * juce::Random::getSystemRandom().nextFloat() * (*randDur);
-                int length = dur * fs;
-               
-                long long int onset = nextGrainOnset + schedDelay;
-                //Density
-                float dens = *density;
-                dens *= 1 + (0.5 - juce::Random::getSystemRandom().nextFloat())* (*randDens);
-                
-                
-               
-                
-                //Position
-                float startPos = (*position + (*randPos) * (juce::Random::getSystemRandom().nextFloat() - 0.5)) * numSamples;
-                startPos = wrap2int(startPos, 0, numSamples);
-
-                
-                //Amplitude
-                float amp = *volume;
-                amp *= 1 - juce::Random::getSystemRandom().nextFloat() * (*randGain);
-                
-                bool R = *reverse;
-                if (0.5 * (*randRev + 1.0f) * juce::Random::getSystemRandom().nextFloat() > 0.5){
-                    R = !R;
-                }
-                //randAmp
-                nextGrainOnset = onset + (dens * dur * fs);
-                grains.add(Grain(onset, length, startPos, *envAttack, *envRelease, *envCurve, r, amp, *reverse));
-                double schedError = ((onset - schedDelay) - time) / fs;
-                dur += schedError;
-                wait(dens * dur * 1000);
-            }else{
-                nextGrainOnset = 0;
-                wait(100);
-            }
-        }else{
-            wait(100);
+        checkPresetSwitch();
+        announceSwitch();
+        checkPreviewPath();
+        freeUnusedBuffers();
+        prepareHeldBuffers();
+        freezeCache.freeUnusedClouds();
+        for (int i = spectra.size() - 1; i >= 0; i--){
+            if (spectra.getUnchecked(i)->getReferenceCount() == 1) spectra.remove(i);
         }
+        freeUnusedIndexes();
+        if (spectrumWanted.exchange(false)) buildSpectrum(loadedBuffer);
+        FreezeRequest request;
+        if (freezeCache.takeRequest(request))
+            analysisQueue.add([this, request] () mutable { renderFrozenCloud(request); });
+        wait(idleWaitTime());
     }
 }
 
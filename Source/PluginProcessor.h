@@ -9,106 +9,27 @@
 #pragma once
 
 #include <JuceHeader.h>
+#include "ReferenceCountedBuffer.h"
+#include "DryVoice.h"
+#include "Grain.h"
+#include "PeakPyramid.h"
+#include "GrainSnapshot.h"
+#include "CaptureBuffer.h"
+#include "GrainPool.h"
+#include "GrainVoice.h"
+#include "ModMatrix.h"
+#include "FreezeCache.h"
+#include "GrainFilterBank.h"
+#include "SpectralGrains.h"
+#include "DecodeCache.h"
+#include "SampleCatalog.h"
+#include "PresetBank.h"
+#include "SharedPools.h"
 
 //==============================================================================
 /**
 */
 
-class Grain
-{
-public:
-    const long long int onset;
-    const int length;
-    const int startPos;
-    
-    
-    const float envAttack, envAttackRecip;
-    const float envRelease, envReleaseRecip;
-    const float envCurve;
-    const float lengthRecip;
-    
-    
-    const float rate;
-    const float amp;
-    const bool rev;
-    const int grainLengthInSample;
-    
-    
-    Grain(): onset(0),length(1000), startPos(0), envAttack(0.3), envAttackRecip(1/envAttack), envRelease(0.7), envReleaseRecip(1/(1-envRelease)),envCurve(0.0), lengthRecip(1/length), rate(1.0), amp(1.0), rev(false), grainLengthInSample(int(length/rate))
-    {}
-    ~Grain(){}
-    Grain(long long int onset,int length,int startPos,float envAttack=0.3, float envR=0.3, float envCurve = 0.0, float rate=1.0, float amp = 1.0, bool reverse = false): onset(onset), length(length), startPos(startPos), envAttack(envAttack), envAttackRecip(1/envAttack), envRelease(1-envR), envReleaseRecip(1/envR), envCurve(envCurve), lengthRecip(1/(float)length), rate(rate),amp(amp), rev(reverse), grainLengthInSample(int(length/rate))
-    {
-        
-    }
-    float envelope(int time){
-        
-        //curve method
-        // if c != 0 => gain = (1 - e^fc) / (1 - e^c)
-        // f is fraction of position in curve (from the lowest point)
-        float gain = 0;
-        float envPos = (float)(time - onset) * lengthRecip;
-        if(envPos <= envAttack){
-            gain = envPos * envAttackRecip;
-            if(std::abs(envCurve) > 0.001 ) return (1.0 - exp(gain * envCurve)) / (1.0 - exp(envCurve));
-            return gain;
-        }else if (envPos >= envRelease){
-            gain = (1-envPos) * envReleaseRecip;
-            if (std::abs(envCurve) > 0.001) return (1.0 - exp(gain * envCurve)) / (1.0 - exp(envCurve));
-            return gain;
-        }else return 1.0;
-    }
-    inline float linearInterp(float x, float y0, float y1) {return x * y0 + (1-x) * y1;}
-    void process (juce::AudioSampleBuffer& currentBlock, juce::AudioSampleBuffer& fileBuffer, int numChannels, int blockNumSamples, int fileNumSamples, long long int time)
-    {
-        for(int channel=0; channel<numChannels; ++channel){
-            const float gain = (int) envelope(time) ;
-
-            float* channelData = currentBlock.getWritePointer(channel);
-            const float* fileData = fileBuffer.getReadPointer(channel%fileBuffer.getNumChannels());
-            float diff = (int) (time - onset);
-            const float position = (float)diff * rate;
-            
-            const int iPosition = (int) std::ceil(position);
-            const float fracPos = iPosition - position;
-            const int rev_p = rev ? -1 : 1;
-//            const float pos = (float) rev_p * (time - onset) * rate ;
-//            const int prevPos = (int) pos;
-//            const int currentPos = prevPos + rev_p;
-
-//            const float frac = rev_p * (pos - prevPos);
-//            float currentSample = fileData[currentPos % length];
-//            const float prevSample = fileData[prevPos % length];
-//            currentSample = linearInterp(frac, prevSample, currentSample) * gain * amp;
-            const int readPos = rev_p * iPosition + startPos + fileNumSamples;
-            float currentSample = fileData[readPos % fileNumSamples];
-//            float a = fileData[(readPos - 3) % fileNumSamples];
-//            float b = fileData[(readPos - 2) % fileNumSamples];
-//            float c = fileData[(readPos - 1) % fileNumSamples];
-            //currentSample = interpolation(fracPos , a, b, c, currentSample);
-            float prevSample = fileData[(readPos - rev_p) % fileNumSamples];
-            currentSample = linearInterp(fracPos, prevSample, currentSample);
-            currentSample = currentSample * gain * amp;
-            channelData[time % blockNumSamples] += currentSample;
-        }
-    }
-};
-class ReferenceCountedBuffer : public juce::ReferenceCountedObject
-{
-public:
-    ReferenceCountedBuffer (const juce::String& buffername, int numChannels, int numSamples):
-    name(buffername),buffer(numChannels, numSamples)
-    {}
-    ~ReferenceCountedBuffer()
-    {}
-    juce::AudioSampleBuffer* get(){
-        return &buffer;
-    }
-    typedef  juce::ReferenceCountedObjectPtr<ReferenceCountedBuffer> Ptr;
-private:
-    juce::String name;
-    juce::AudioSampleBuffer buffer;
-};
 class CranulatorAudioProcessor  : public juce::AudioProcessor, public juce::Thread
                             #if JucePlugin_Enable_ARA
                              , public juce::AudioProcessorARAExtension
@@ -130,7 +51,15 @@ public:
    #endif
 
     void processBlock (juce::AudioBuffer<float>&, juce::MidiBuffer&) override;
-    void processMidi (juce::MidiBuffer& midiMessage, int numSamples);
+    void processBlock (juce::AudioBuffer<double>&, juce::MidiBuffer&) override;
+    bool supportsDoublePrecisionProcessing() const override;
+    void handleMidiEvent (const juce::MidiMessage& m, long long int when, const GrainParams& params);
+    template <typename SampleType>
+    void processBlockInternal (juce::AudioBuffer<SampleType>& buffer, juce::MidiBuffer& midiMessages);
+    template <typename SampleType>
+    void processIdle (juce::AudioBuffer<SampleType>& buffer, int numSamplesInFile, bool live);
+    template <typename SampleType>
+    void addOutgoing (juce::AudioBuffer<SampleType>& segment, long long int segmentTime);
 
     //==============================================================================
     juce::AudioProcessorEditor* createEditor() override;
@@ -162,11 +91,6 @@ public:
     
     double fs;
     long long int time;
-    long long int nextGrainOnset;
-    
-    //grains
-    juce::Array<Grain> grains;
-    int midiNotes[128] = {0};
     
     // Parameters
     juce::AudioParameterFloat* position;
@@ -186,31 +110,239 @@ public:
     juce::AudioParameterFloat * envAttack;
     juce::AudioParameterFloat* envRelease;
     juce::AudioParameterFloat* envCurve;
+    juce::AudioParameterFloat* cullLevel;
+    // granulate the input bus through the capture ring instead of the loaded file
+    juce::AudioParameterBool* liveInput;
+    // per-grain placement: centre, random scatter around it, and how far apart a stereo file's channels sit
+    juce::AudioParameterFloat* pan;
+    juce::AudioParameterFloat* spread;
+    juce::AudioParameterFloat* width;
+    // how long a released note keeps spawning grains, fading out, in seconds
+    juce::AudioParameterFloat* releaseTail;
+    // resonant filter on every grain, the cutoff scattered per grain by randCutoff
+    juce::AudioParameterChoice* filterMode;
+    juce::AudioParameterFloat* cutoff;
+    juce::AudioParameterFloat* resonance;
+    juce::AudioParameterFloat* randCutoff;
+    // modulation: two LFOs, a stepped random source and a note envelope, routed by four slots
+    juce::AudioParameterFloat* lfoRate[ModMatrix::numLfos];
+    juce::AudioParameterChoice* lfoShape[ModMatrix::numLfos];
+    juce::AudioParameterFloat* randomRate;
+    juce::AudioParameterFloat* modEnvAttack;
+    juce::AudioParameterFloat* modEnvDecay;
+    juce::AudioParameterFloat* modEnvSustain;
+    juce::AudioParameterChoice* modSource[ModMatrix::numSlots];
+    juce::AudioParameterChoice* modDestination[ModMatrix::numSlots];
+    juce::AudioParameterFloat* modDepth[ModMatrix::numSlots];
+    // once held notes and knobs sit still, loop a background render of the cloud instead of rendering it
+    juce::AudioParameterBool* freeze;
+    juce::AudioParameterFloat* freezeLength;
+    // resynthesise grains from the file's spectrum: pitch without changing how fast the grain moves through the file
+    juce::AudioParameterBool* spectral;
+    // moves grain starts out of silence or onto onsets, using the file's analysis index
+    juce::AudioParameterChoice* placement;
+    // grains two pitch periods long on the file's pitch marks, repeated at the note's pitch: transposes and keeps the formants
+    juce::AudioParameterBool* pitchSync;
+    // how grains read between samples, for playback and for offline renders
+    juce::AudioParameterChoice* interpolation;
+    juce::AudioParameterChoice* offlineInterpolation;
     
     
     
     //Utility
     int wrap2int(int val, const int min, const int max);
     float clip(float sample, const float min, const float max);
+    // true while any voice is held, the dry voice only plays then
     bool noteOn;
     juce::MidiKeyboardState keyboardState;
     
     //LoadFile
     void loadFile(const juce::String & path);
+    // compact modes keep the file as 16-bit interleaved frames, changing it reloads the current file
+    void setSampleStorage(SampleStorage newStorage);
+    SampleStorage sampleStorage = SampleStorage::planarFloat;
+    // loads on the scheduler thread, so decoding and prefaulting never block the editor or the audio thread
+    void requestLoad(const juce::String & path);
+    // true when one of our formats reads files with this one's extension
+    bool canLoad(const juce::String& path) const;
+    // the browser auditions a file on top of whatever is playing, decoded through the shared cache
+    void requestPreview(const juce::String& path);
+    void stopPreview();
+    //held here so the catalog, and any scan it is running, outlives the editor
+    juce::SharedResourcePointer<SampleCatalog> catalog;
     bool checkRestorePath();
     juce::String restorePath;
-    juce::String filePath;
+    juce::CriticalSection pathLock;
+    SampleArena::Stats getSampleMemoryStats() const {return sampleArena->getStats();}
+    // waveform overview of the current file, null until it has been built
+    PeakPyramid::Ptr getOverview() const{
+        const juce::SpinLock::ScopedLockType sl(overviewLock);
+        return overview;
+    }
+    juce::ChangeBroadcaster overviewChanged;
+    // share of the block's real time spent rendering it, averaged by the measurer
+    double getRenderLoad() const {return loadMeasurer.getLoadAsProportion();}
+    // grains sounding at the start of the last block, written by the audio thread, read by the editor
+    TripleBuffer<GrainSnapshot> grainSnapshots;
+    // the last file loaded; the scheduler sets it and the editor and host read it, so it sits behind pathLock
+    juce::String getFilePath() const{
+        const juce::ScopedLock sl(pathLock);
+        return filePath;
+    }
+    // the file the audio thread plays, only ever written by the audio thread when it takes a switch
     juce::ReferenceCountedObjectPtr<ReferenceCountedBuffer> fileBuffer;
+    // the host's programs; a switch swaps knobs and file at the top of a block and crossfades the two clouds
+    PresetBank presets;
+    // the current knobs and file, under `name` in slot `index`
+    void storePreset(int index, const juce::String& name);
+    //the state is written in binary: this, a version, the storage, the current preset, the live knobs and the bank
+    static constexpr int stateMagic = 0x534e5243; //"CRNS"
+    static constexpr int stateVersion = 1;
     
 private:
+    juce::String filePath;
+    void setFilePath(const juce::String& path){
+        const juce::ScopedLock sl(pathLock);
+        filePath = path;
+    }
+    juce::AudioProcessLoadMeasurer loadMeasurer;
+    juce::SharedResourcePointer<DecodeCache> decodeCache;
+    //preview: the scheduler decodes and publishes, the audio thread plays the file once from the start
+    void checkPreviewPath();
+    template <typename SampleType>
+    void addPreview(juce::AudioBuffer<SampleType>& buffer);
+    juce::String previewPath;
+    DecodeCache::Decoded publishedPreview;
+    int publishedPreviewId = 0;
+    juce::SpinLock previewLock;
+    int previewPlaying = 0;
+    ReferenceCountedBuffer::Ptr previewBuffer;
+    double previewStep = 1;
+    juce::int64 previewLeft = 0;
+    DryVoice previewVoice;
     inline float linearInterp(float x, float y0, float y1) {return x * y1 + (1-x) * y0;}
     juce::AudioFormatManager formatManager;
     juce::AudioDeviceManager deviceManager;
-    float currentPos;
+    DryVoice dryVoice;
+    CaptureBuffer capture;
+    //where the output channels sit, set in prepareToPlay, never while a block is running
+    SpeakerLayout speakerLayout;
+    //one grain stream per held or released note, all spawning into the same pool on the audio thread
+    GrainVoice voices[GrainVoice::maxVoices];
+    GrainPool grainPool;
+    GrainFilterBank grainFilters;
+    //seeds each new voice, so a voice's grains depend only on its own note and not on the other voices or the block size
+    juce::Random random;
+    //every stream restarts from this in prepareToPlay, so two renders of a session match
+    static constexpr juce::int64 randomSeed = 0x4352414e;
+    GrainParams readParams() const;
+    ModMatrix modMatrix;
+    ModMatrix::Settings readModSettings() const;
+    void spawnGrains (GrainVoice& voice, const ReferenceCountedBuffer& source, int outChannels, long long int until,
+                      GrainPool& pool, const ModMatrix& mods, const SpeakerLayout& layout, const SourceIndex* index,
+                      SpectralGrains* spectralPool = nullptr);
+    //spectral mode: the audio thread only reads a published spectrum, the scheduler builds one when asked
+    SpectralGrains spectralGrains;
+    SpectralFrames::Ptr spectrum;
+    const ReferenceCountedBuffer* spectrumRequestedFor = nullptr;
+    std::atomic<bool> spectrumWanted {false};
+    //the analysis index of the current file, taken from publishedIndex once it is ready
+    SourceIndex::Ptr sourceIndex;
+    //freeze: the render job has its own pool and matrix, so it never touches the audio thread's
+    FreezeCache freezeCache;
+    int noteGeneration = 0;
+    ModMatrix freezeMods;
+    GrainPool freezePool;
+    GrainFilterBank freezeFilters;
+    void renderFrozenCloud (FreezeRequest& request);
+    double captureSeconds = 10.0;
+    void publishGrainSnapshot(int numEntries);
+    int lastSnapshotSize = 0;
+    juce::SharedResourcePointer<SampleArena> sampleArena;
+    //every loaded file stays here until only this array refers to it
+    juce::ReferenceCountedArray<ReferenceCountedBuffer> buffers;
+    void freeUnusedBuffers();
+    //the host can switch to double precision with files already published, pending or warm; set by prepareToPlay
+    //and by an audio thread left with a buffer that isn't ready, the scheduler then makes every double copy
+    std::atomic<bool> precisionWanted {false};
+    void prepareHeldBuffers();
+    //what the audio thread holds, set by it after taking and cleared after dropping; it notifies the scheduler on every change
+    std::atomic<const ReferenceCountedBuffer*> audioFile {nullptr}, audioOutgoing {nullptr}, audioPreview {nullptr};
+    std::atomic<const SourceIndex*> audioIndex {nullptr};
+    //builds the overview of each loaded file off the scheduler thread, one job at a time on the process's shared pool
+    BackgroundQueue analysisQueue;
+    void buildOverview(ReferenceCountedBuffer::Ptr buffer);
+    PeakPyramid::Ptr overview;
+    juce::SpinLock overviewLock;
+    std::atomic<int> overviewGeneration {0};
+    //the spectrum of the current file, built on analysisQueue and spread over the shared parallel pool, only once spectral mode asks for it
+    void buildSpectrum(ReferenceCountedBuffer::Ptr buffer);
+    const ReferenceCountedBuffer* spectrumBuiltFor = nullptr;
+    std::atomic<int> spectrumGeneration {0};
+    SpectralFrames::Ptr publishedSpectrum;
+    juce::SpinLock spectrumLock;
+    juce::ReferenceCountedArray<SpectralFrames, juce::CriticalSection> spectra;
+    //onsets, loudness, brightness and pitch marks of each loaded file, read from its sidecar or analysed on the shared parallel pool
+    void buildIndex(ReferenceCountedBuffer::Ptr buffer, double fileSampleRate, const juce::File& audioFile);
+    std::atomic<int> indexGeneration {0};
+    SourceIndex::Ptr publishedIndex;
+    juce::SpinLock indexLock;
+    juce::ReferenceCountedArray<SourceIndex, juce::CriticalSection> indexes;
+    void freeUnusedIndexes();
+    //presets: the scheduler readies the file, the audio thread takes knobs and file together at the top of a block
+    struct PresetSwitch
+    {
+        ReferenceCountedBuffer::Ptr buffer;   //null keeps the current file
+        std::vector<float> values;            //normalised, in getParameters() order
+    };
+    std::atomic<int> currentPreset {0};
+    std::atomic<int> wantedPreset {-1};
+    void checkPresetSwitch();
+    //loads and presets both hand their file over here, so fileBuffer has one writer
+    void publishSwitch(PresetSwitch next);
+    PresetSwitch publishedSwitch;
+    int publishedSwitchId = 0;
+    juce::SpinLock switchLock;
+    int switchPlaying = 0;
+    //the scheduler's copy of the last file it handed over
+    ReferenceCountedBuffer::Ptr loadedBuffer;
+    void takePresetSwitch();
+    void endPresetFade();
+    //the audio thread sets the knobs of a switch quietly and counts it, the scheduler then tells the host and the editor
+    std::atomic<int> switchesTaken {0};
+    int switchesAnnounced = 0;
+    void announceSwitch();
+    //the previous preset's cloud, moved aside whole and faded out against its own file
+    static constexpr double presetFadeSeconds = 0.02;
+    GrainPool outgoingPool;
+    GrainFilterBank outgoingFilters;
+    SpectralGrains outgoingSpectral;
+    ReferenceCountedBuffer::Ptr outgoingBuffer;
+    SpectralFrames::Ptr outgoingFrames;
+    DryVoice outgoingDry;
+    double outgoingStep = 1;
+    float outgoingBlend = 1;
+    bool outgoingDryOn = false;
+    int fadeLeft = 0, fadeLength = 1;
+    //the files of the current preset and its neighbours, decoded and indexed ahead of a switch
+    struct WarmSource
+    {
+        juce::String path;
+        SampleStorage storage = SampleStorage::planarFloat;
+        DecodeCache::Decoded decoded;
+        SourceIndex::Ptr index;
+    };
+    void warmPresets(int index);
+    WarmSource findWarm(const juce::String& path, SampleStorage storage) const;
+    std::vector<WarmSource> warmSources;
+    juce::CriticalSection warmLock;
+    std::atomic<int> warmGeneration {0};
+    BackgroundQueue warmingQueue;
+    //the audio thread wakes the scheduler whenever it lets go of a file or an index, so only clouds and spectra are polled
+    int idleWaitTime() const {return freezeCache.hasClouds() || spectra.size() > 1 ? 500 : -1;}
     float rate;
     float binsPerOctave;
     juce::File fileToPlay;
-    int schedDelay;
     juce::FileLogger* crLog = juce::FileLogger::createDefaultAppLogger("CRN", "CRN.log", "CRN LOG:", 256*1024);
     
 
@@ -0,0 +1,119 @@
+/*
+  ==============================================================================
+
+    PresetBank.h
+    Numbered presets, each a set of parameter values and a source file, kept in a compact binary form.
+
+  ==============================================================================
+*/
+
+#pragma once
+
+#include <JuceHeader.h>
+
+//==============================================================================
+/**
+    The bank is what the host sees as the plugin's programs. A preset keeps
+    every parameter by its ID as a normalised value, so a preset saved before a
+    parameter was added still loads, with the new one at its default. It also
+    keeps the file it plays. An empty path keeps whatever file is loaded.
+
+    Presets and the plugin state are written with the same binary calls: a
+    count, then an ID and a float per parameter. That is a fraction of the XML
+    it replaces and is read back without parsing.
+
+    The editor and the host change the bank on the message thread, and the
+    scheduler reads it to warm sources, so every call copies under the lock.
+*/
+class PresetBank
+{
+public:
+    static constexpr int numSlots = 16;
+    //anything above these is a corrupt or truncated chunk, not a bigger bank
+    static constexpr int maxStoredSlots = 1024;
+    static constexpr int maxValues = 4096;
+
+    struct Preset
+    {
+        juce::String name, path;
+        std::vector<std::pair<juce::String, float>> values;
+
+        bool isEmpty() const {return values.empty();}
+
+        // the stored value of a parameter, or `fallback` when the preset predates it
+        float get(const juce::String& paramID, float fallback) const{
+            for (const auto& v : values) if (v.first == paramID) return v.second;
+            return fallback;
+        }
+
+        void write(juce::OutputStream& out) const{
+            out.writeString(name);
+            out.writeString(path);
+            out.writeCompressedInt((int) values.size());
+            for (const auto& v : values){
+                out.writeString(v.first);
+                out.writeFloat(v.second);
+            }
+        }
+        bool read(juce::InputStream& in){
+            name = in.readString();
+            path = in.readString();
+            const int numValues = in.readCompressedInt();
+            if (numValues < 0 || numValues > maxValues) return false;
+            values.clear();
+            for (int i = 0; i < numValues && ! in.isExhausted(); i++){
+                const juce::String paramID = in.readString();
+                values.emplace_back(paramID, in.readFloat());
+            }
+            return (int) values.size() == numValues;
+        }
+    };
+
+    Preset get(int index) const{
+        const juce::ScopedLock sl(lock);
+        return juce::isPositiveAndBelow(index, numSlots) ? slots[(size_t) index] : Preset();
+    }
+    void set(int index, const Preset& preset){
+        const juce::ScopedLock sl(lock);
+        if (juce::isPositiveAndBelow(index, numSlots)) slots[(size_t) index] = preset;
+    }
+    void rename(int index, const juce::String& name){
+        const juce::ScopedLock sl(lock);
+        if (juce::isPositiveAndBelow(index, numSlots)) slots[(size_t) index].name = name;
+    }
+    // empty slots are shown by number
+    juce::String getName(int index) const{
+        const juce::ScopedLock sl(lock);
+        if (! juce::isPositiveAndBelow(index, numSlots)) return {};
+        const Preset& p = slots[(size_t) index];
+        return p.name.isNotEmpty() ? p.name : "Preset " + juce::String(index + 1);
+    }
+
+    void write(juce::OutputStream& out) const{
+        const juce::ScopedLock sl(lock);
+        out.writeCompressedInt(numSlots);
+        for (const Preset& p : slots) p.write(out);
+    }
+    // leaves the bank as it was when the stream is cut short
+    bool read(juce::InputStream& in){
+        std::array<Preset, numSlots> loaded;
+        const int numStored = in.readCompressedInt();
+        if (numStored < 0 || numStored > maxStoredSlots) return false;
+        for (int i = 0; i < numStored; i++){
+            //an exhausted stream reads as zeros, which would pass for empty presets
+            if (in.isExhausted()) return false;
+            Preset p;
+            if (! p.read(in)) return false;
+            if (i < numSlots) loaded[(size_t) i] = std::move(p);
+        }
+        const juce::ScopedLock sl(lock);
+        slots = std::move(loaded);
+        return true;
+    }
+
+private:
+    std::array<Preset, numSlots> slots;
+    juce::CriticalSection lock;
+
+    JUCE_DECLARE_NON_COPYABLE (PresetBank)
+};
@@ -0,0 +1,242 @@
+/*
+  ==============================================================================
+
+    ReferenceCountedBuffer.h
+    The decoded file shared between the loader, the scheduler and the audio thread.
+
+  ==============================================================================
+*/
+
+#pragma once
+
+#include <JuceHeader.h>
+#include "SampleArena.h"
+
+//==============================================================================
+// How a loaded file is kept in memory. The compact modes store interleaved
+// frames at 16 bits per sample and are converted while the grains read them.
+enum class SampleStorage
+{
+    planarFloat,
+    interleavedInt16,
+    interleavedHalf
+};
+
+namespace Half
+{
+    inline juce::uint16 fromFloat(float f)
+    {
+        juce::uint32 x;
+        std::memcpy(&x, &f, sizeof(x));
+        const juce::uint32 sign = (x >> 16) & 0x8000;
+        const juce::uint32 absX = x & 0x7fffffff;
+        if (absX >= 0x7f800000) return (juce::uint16) (sign | (absX > 0x7f800000 ? 0x7e00 : 0x7c00)); //nan, inf
+        if (absX >= 0x477ff000) return (juce::uint16) (sign | 0x7c00);                                  //overflows to inf
+        if (absX < 0x38800000){
+            //subnormal half, round to nearest
+            float a;
+            const juce::uint32 bits = absX;
+            std::memcpy(&a, &bits, sizeof(a));
+            return (juce::uint16) (sign | (juce::uint32) std::lrint(a * 16777216.0f));
+        }
+        const juce::uint32 rounded = absX + 0xfff + ((absX >> 13) & 1) - (112u << 23); //round to nearest even, rebias
+        return (juce::uint16) (sign | (rounded >> 13));
+    }
+
+    inline float toFloat(juce::uint16 h)
+    {
+        //rebias the exponent, then fix up inf/nan and subnormals without a table
+        const juce::uint32 shiftedExp = 0x7c00u << 13;
+        juce::uint32 o = ((juce::uint32) h & 0x7fff) << 13;
+        const juce::uint32 exp = shiftedExp & o;
+        o += (127u - 15u) << 23;
+        if (exp == shiftedExp) o += (128u - 16u) << 23;
+        else if (exp == 0){
+            o += 1u << 23;
+            float f;
+            std::memcpy(&f, &o, sizeof(f));
+            f -= 6.10351562e-05f;
+            std::memcpy(&o, &f, sizeof(o));
+        }
+        o |= ((juce::uint32) h & 0x8000) << 16;
+        float f;
+        std::memcpy(&f, &o, sizeof(f));
+        return f;
+    }
+}
+
+//==============================================================================
+// One channel of the file as the kernels see it: sample i of that channel.
+template <typename SampleType>
+struct PlanarReader
+{
+    static constexpr bool contiguous = true;
+    const SampleType* data;
+    SampleType operator[] (int i) const {return data[i];}
+};
+
+template <typename SampleType>
+struct Int16Reader
+{
+    static constexpr bool contiguous = false;
+    const juce::int16* data;
+    int stride;
+    SampleType operator[] (int i) const {return (SampleType) data[i * stride] * (SampleType) (1.0 / 32768.0);}
+};
+
+template <typename SampleType>
+struct HalfReader
+{
+    static constexpr bool contiguous = false;
+    const juce::uint16* data;
+    int stride;
+    SampleType operator[] (int i) const {return (SampleType) Half::toFloat(data[i * stride]);}
+};
+
+//==============================================================================
+/**
+    All of the sample memory comes from the SampleArena, so it is prefaulted and
+    locked before the audio thread ever reads it. The AudioBuffers only refer to
+    that memory, each channel starting on a 16-byte boundary.
+*/
+class ReferenceCountedBuffer : public juce::ReferenceCountedObject
+{
+public:
+    ReferenceCountedBuffer (const juce::String& buffername, int numChannels, int numSamples):
+    name(buffername), numChannels(numChannels), numSamples(numSamples)
+    {
+        planarData = referToArena(buffer);
+    }
+    ~ReferenceCountedBuffer()
+    {}
+    // the planar float data, only valid while the storage is planarFloat
+    juce::AudioSampleBuffer* get(){
+        return &buffer;
+    }
+    int getNumChannels() const {return numChannels;}
+    int getNumSamples() const {return numSamples;}
+    SampleStorage getStorage() const {return storage;}
+
+    // repacks the decoded float data into interleaved 16-bit frames and frees it, call before sharing the buffer
+    void compact(SampleStorage newStorage){
+        if (storage != SampleStorage::planarFloat || newStorage == SampleStorage::planarFloat) return;
+        compactData = arena->allocate((size_t) numChannels * (size_t) numSamples * sizeof(juce::uint16));
+        juce::uint16* frames = static_cast<juce::uint16*> (compactData->getData());
+        for (int c = 0; c < numChannels; c++){
+            const float* src = buffer.getReadPointer(c);
+            juce::uint16* frame = frames + c;
+            if (newStorage == SampleStorage::interleavedInt16){
+                for (int i = 0; i < numSamples; i++)
+                    frame[i * numChannels] = (juce::uint16) (juce::int16) juce::jlimit(-32768, 32767, (int) std::lrint(src[i] * 32768.0f));
+            }else{
+                for (int i = 0; i < numSamples; i++)
+                    frame[i * numChannels] = Half::fromFloat(src[i]);
+            }
+        }
+        storage = newStorage;
+        buffer = juce::AudioSampleBuffer();
+        doubleBuffer = juce::AudioBuffer<double>();
+        doubleReady.store(false);
+        planarData.reset();
+        doubleData.reset();
+    }
+    // makes the double copy used when the host processes in double precision, never call it from the audio thread
+    void prepareDoublePrecision(){
+        //buffers from the DecodeCache are shared, so two instances' loaders may get here at once
+        const juce::ScopedLock sl(prepareLock);
+        if (storage != SampleStorage::planarFloat || doubleReady.load()) return;
+        //another instance's audio thread may be checking isReadyFor, so the copy is filled aside and only then published
+        juce::AudioBuffer<double> copy;
+        std::unique_ptr<SampleArena::Block> block = referToArena(copy);
+        for (int c = 0; c < numChannels; c++){
+            const float* src = buffer.getReadPointer(c);
+            double* dst = copy.getWritePointer(c);
+            for (int i = 0; i < numSamples; i++) dst[i] = (double) src[i];
+        }
+        doubleBuffer = std::move(copy);
+        doubleData = std::move(block);
+        doubleReady.store(true, std::memory_order_release);
+    }
+    // compact storage converts straight to either sample type, planar doubles need prepareDoublePrecision
+    template <typename SampleType>
+    bool isReadyFor() const{
+        if constexpr (std::is_same_v<SampleType, double>)
+            return storage != SampleStorage::planarFloat || doubleReady.load(std::memory_order_acquire);
+        else return true;
+    }
+    template <typename SampleType>
+    const juce::AudioBuffer<SampleType>* getBuffer() const{
+        if constexpr (std::is_same_v<SampleType, double>) return doubleReady.load(std::memory_order_acquire) ? &doubleBuffer : nullptr;
+        else return &buffer;
+    }
+    // writable planar data for the capture ring, null when that precision has not been prepared
+    template <typename SampleType>
+    juce::AudioBuffer<SampleType>* getWriteBuffer(){
+        if (storage != SampleStorage::planarFloat) return nullptr;
+        if constexpr (std::is_same_v<SampleType, double>) return doubleReady.load(std::memory_order_acquire) ? &doubleBuffer : nullptr;
+        else return &buffer;
+    }
+    template <typename SampleType, SampleStorage Storage>
+    auto getReader(int channel) const{
+        const juce::uint16* frames = compactData != nullptr ? static_cast<const juce::uint16*> (compactData->getData()) : nullptr;
+        if constexpr (Storage == SampleStorage::interleavedInt16)
+            return Int16Reader<SampleType> {reinterpret_cast<const juce::int16*> (frames) + channel, numChannels};
+        else if constexpr (Storage == SampleStorage::interleavedHalf)
+            return HalfReader<SampleType> {frames + channel, numChannels};
+        else
+            return PlanarReader<SampleType> {getBuffer<SampleType>()->getReadPointer(channel)};
+    }
+    // numToRead samples of one channel from `start` on, wrapping round the end like the grains do, for background analysis
+    void readCircular(int channel, juce::int64 start, float* out, int numToRead) const{
+        switch (storage){
+            case SampleStorage::interleavedInt16: readCircular(getReader<float, SampleStorage::interleavedInt16>(channel), start, out, numToRead); break;
+            case SampleStorage::interleavedHalf: readCircular(getReader<float, SampleStorage::interleavedHalf>(channel), start, out, numToRead); break;
+            default: readCircular(getReader<float, SampleStorage::planarFloat>(channel), start, out, numToRead); break;
+        }
+    }
+    // bytes of sample memory held, in every format the buffer keeps
+    size_t getMemorySize() const{
+        size_t total = 0;
+        for (const auto* block : {planarData.get(), doubleData.get(), compactData.get()})
+            if (block != nullptr) total += block->getSize();
+        return total;
+    }
+    typedef  juce::ReferenceCountedObjectPtr<ReferenceCountedBuffer> Ptr;
+private:
+    template <typename Reader>
+    void readCircular(const Reader& reader, juce::int64 start, float* out, int numToRead) const{
+        if (numSamples == 0){
+            std::fill(out, out + numToRead, 0.0f);
+            return;
+        }
+        int idx = (int) (start % numSamples);
+        if (idx < 0) idx += numSamples;
+        for (int i = 0; i < numToRead; i++){
+            out[i] = reader[idx];
+            if (++idx == numSamples) idx = 0;
+        }
+    }
+
+    // points the buffer at a fresh arena block and returns the block that now owns its memory
+    template <typename SampleType>
+    std::unique_ptr<SampleArena::Block> referToArena(juce::AudioBuffer<SampleType>& target){
+        const size_t stride = ((size_t) numSamples + 3) & ~(size_t) 3;
+        auto block = arena->allocate(stride * (size_t) numChannels * sizeof(SampleType));
+        juce::HeapBlock<SampleType*> channels((size_t) juce::jmax(numChannels, 1));
+        for (int c = 0; c < numChannels; c++) channels[c] = static_cast<SampleType*> (block->getData()) + stride * (size_t) c;
+        target.setDataToReferTo(channels.get(), numChannels, numSamples);
+        return block;
+    }
+
+    juce::SharedResourcePointer<SampleArena> arena;
+    juce::String name;
+    const int numChannels;
+    const int numSamples;
+    std::unique_ptr<SampleArena::Block> planarData, doubleData, compactData;
+    juce::CriticalSection prepareLock;
+    juce::AudioSampleBuffer buffer;
+    juce::AudioBuffer<double> doubleBuffer;
+    //set once doubleBuffer is filled, it is never written again after that
+    std::atomic<bool> doubleReady {false};
+    SampleStorage storage = SampleStorage::planarFloat;
+};
@@ -0,0 +1,197 @@
+/*
+  ==============================================================================
+
+    SampleArena.h
+    Page-locked, prefaulted memory for decoded sample data.
+
+  ==============================================================================
+*/
+
+#pragma once
+
+#include <JuceHeader.h>
+
+#if JUCE_LINUX || JUCE_MAC || JUCE_BSD
+ #include <sys/mman.h>
+ #include <unistd.h>
+ #define CRANULATOR_SAMPLE_ARENA_MMAP 1
+#else
+ #define CRANULATOR_SAMPLE_ARENA_MMAP 0
+#endif
+
+//==============================================================================
+/**
+    Grains read the file at random positions, so the first touch of a page (or
+    a page the OS swapped out) would fault inside the audio callback. Every block
+    handed out here is written page by page before it is returned, and locked
+    into RAM while the locked total stays under the budget.
+
+    One arena is shared by every instance in the process through
+    juce::SharedResourcePointer, so the lock budget is per process. It starts
+    at defaultLockBudget: enough for several long stereo files, and small
+    enough that a session full of instances can't pin the machine's RAM. A
+    host or standalone wrapper can change it with setLockBudget before the
+    first file is loaded. Blocks past it are still prefaulted, just not
+    locked, and show up in Stats::bytesUnlocked. Allocate and free only from
+    the loader thread, never from the audio thread.
+*/
+class SampleArena
+{
+public:
+    struct Stats
+    {
+        juce::int64 bytesMapped = 0;
+        juce::int64 bytesLocked = 0;
+        juce::int64 hugePageBytes = 0;
+        juce::int64 bytesUnlocked = 0;  //over the budget or refused by mlock, these pages can still be swapped out
+        int numBlocks = 0;
+        int lockFailures = 0;
+    };
+
+    //==============================================================================
+    class Block
+    {
+    public:
+        ~Block();
+        void* getData() const {return data;}
+        size_t getSize() const {return size;}
+        bool isLocked() const {return locked;}
+
+    private:
+        friend class SampleArena;
+        Block() = default;
+        juce::SharedResourcePointer<SampleArena> arena; //keeps the arena alive for as long as a block is out
+        void* data = nullptr;
+        size_t size = 0, mappedSize = 0;
+        bool locked = false, huge = false, mapped = false;
+
+        JUCE_DECLARE_NON_COPYABLE (Block)
+    };
+
+    //==============================================================================
+    static constexpr juce::int64 defaultLockBudget = (juce::int64) 256 * 1024 * 1024;
+    // total bytes that may be mlocked across all blocks, 0 turns locking off.
+    // Only blocks allocated afterwards see it, so call it before the first file is loaded.
+    static void setLockBudget(juce::int64 bytes) {lockBudget() = juce::jmax((juce::int64) 0, bytes);}
+    static juce::int64 getLockBudget() {return lockBudget();}
+
+    // zeroed, prefaulted and (budget permitting) locked memory of at least numBytes
+    std::unique_ptr<Block> allocate(size_t numBytes)
+    {
+        std::unique_ptr<Block> block (new Block());
+        block->size = numBytes;
+        map(*block);
+        prefault(*block);
+        lock(*block);
+
+        const juce::ScopedLock sl(statsLock);
+        stats.bytesMapped += (juce::int64) block->mappedSize;
+        stats.numBlocks++;
+        if (block->huge) stats.hugePageBytes += (juce::int64) block->mappedSize;
+        if (! block->locked && block->data != nullptr) stats.bytesUnlocked += (juce::int64) block->mappedSize;
+        return block;
+    }
+
+    Stats getStats() const
+    {
+        const juce::ScopedLock sl(statsLock);
+        return stats;
+    }
+
+private:
+    static constexpr size_t hugePageSize = 2 * 1024 * 1024;
+    static size_t roundUp(size_t n, size_t multiple) {return (n + multiple - 1) / multiple * multiple;}
+    static size_t pageSize(){
+       #if CRANULATOR_SAMPLE_ARENA_MMAP
+        return (size_t) sysconf(_SC_PAGESIZE);
+       #else
+        return 4096;
+       #endif
+    }
+
+    void map(Block& b)
+    {
+        const size_t numBytes = juce::jmax(b.size, (size_t) 1);
+       #if CRANULATOR_SAMPLE_ARENA_MMAP
+        #if JUCE_LINUX && defined (MAP_HUGETLB)
+        //explicit huge pages on Linux first, transparent ones advised otherwise
+        if (numBytes >= hugePageSize){
+            //only succeeds when the admin has reserved huge pages, so fall through quietly
+            const size_t hugeSize = roundUp(numBytes, hugePageSize);
+            void* p = mmap(nullptr, hugeSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (p != MAP_FAILED){
+                b.data = p; b.mappedSize = hugeSize; b.huge = true; b.mapped = true;
+                return;
+            }
+        }
+        #endif
+        const size_t mappedSize = roundUp(numBytes, pageSize());
+        void* p = mmap(nullptr, mappedSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p != MAP_FAILED){
+           #if JUCE_LINUX && defined (MADV_HUGEPAGE)
+            if (mappedSize >= hugePageSize) madvise(p, mappedSize, MADV_HUGEPAGE);
+           #endif
+            b.data = p; b.mappedSize = mappedSize; b.mapped = true;
+            return;
+        }
+       #endif
+        b.mappedSize = roundUp(numBytes, pageSize());
+        b.data = std::calloc(1, b.mappedSize);
+        jassert(b.data != nullptr);
+    }
+
+    // writes one byte per page so the kernel backs all of it now rather than on first read
+    void prefault(Block& b)
+    {
+        if (b.data == nullptr) return;
+        const size_t step = b.huge ? hugePageSize : pageSize();
+        volatile char* bytes = static_cast<char*> (b.data);
+        for (size_t i = 0; i < b.mappedSize; i += step) bytes[i] = 0;
+    }
+
+    void lock(Block& b)
+    {
+       #if CRANULATOR_SAMPLE_ARENA_MMAP
+        if (b.data == nullptr) return;
+        const juce::ScopedLock sl(statsLock);
+        if (stats.bytesLocked + (juce::int64) b.mappedSize > lockBudget().load()) return;
+        if (mlock(b.data, b.mappedSize) == 0){
+            b.locked = true;
+            stats.bytesLocked += (juce::int64) b.mappedSize;
+        }else stats.lockFailures++; //usually RLIMIT_MEMLOCK, the block still works unlocked
+       #else
+        juce::ignoreUnused(b);
+       #endif
+    }
+
+    void release(Block& b)
+    {
+        if (b.data == nullptr) return;
+        {
+            const juce::ScopedLock sl(statsLock);
+            stats.bytesMapped -= (juce::int64) b.mappedSize;
+            stats.numBlocks--;
+            if (b.huge) stats.hugePageBytes -= (juce::int64) b.mappedSize;
+            if (b.locked) stats.bytesLocked -= (juce::int64) b.mappedSize;
+            else stats.bytesUnlocked -= (juce::int64) b.mappedSize;
+        }
+       #if CRANULATOR_SAMPLE_ARENA_MMAP
+        if (b.mapped){
+            if (b.locked) munlock(b.data, b.mappedSize);
+            munmap(b.data, b.mappedSize);
+            return;
+        }
+       #endif
+        std::free(b.data);
+    }
+
+    static std::atomic<juce::int64>& lockBudget(){
+        static std::atomic<juce::int64> budget {defaultLockBudget};
+        return budget;
+    }
+
+    juce::CriticalSection statsLock;
+    Stats stats;
+};
+
+inline SampleArena::Block::~Block() {arena->release(*this);}
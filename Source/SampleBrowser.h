@@ -0,0 +1,139 @@
+/*
+  ==============================================================================
+
+    SampleBrowser.h
+    Searchable list of the sample catalog, with preview on click and load on double click.
+
+  ==============================================================================
+*/
+
+#pragma once
+
+#include <JuceHeader.h>
+#include "PluginProcessor.h"
+
+//==============================================================================
+/**
+    Shows the catalog's current listing, narrowed by the search box. Typing
+    only filters the listing in memory, so it keeps up with tens of thousands
+    of files. Showing the browser starts an incremental rescan, and the list
+    refreshes when the new listing arrives.
+
+    Selecting a row previews the file and double clicking loads it. Both go
+    through the processor's loader thread and the shared decode cache, so a
+    previewed file loads without being decoded again.
+*/
+class SampleBrowser : public juce::Component, private juce::ListBoxModel, private juce::ChangeListener
+{
+public:
+    explicit SampleBrowser(CranulatorAudioProcessor& p) : processor(p)
+    {
+        addAndMakeVisible(search);
+        search.setTextToShowWhenEmpty("search", juce::Colours::darkgrey);
+        search.onTextChange = [this]{ refilter(); };
+        addAndMakeVisible(addButton);
+        addButton.onClick = [this]{ chooseFolder(); };
+        addAndMakeVisible(rescanButton);
+        rescanButton.onClick = [this]{ catalog->rescan(); updateStatus(); };
+        addAndMakeVisible(status);
+        status.setJustificationType(juce::Justification::centredRight);
+        addAndMakeVisible(list);
+        list.setModel(this);
+        list.setRowHeight(18);
+        catalog->changed.addChangeListener(this);
+        refilter();
+    }
+    ~SampleBrowser() override
+    {
+        catalog->changed.removeChangeListener(this);
+        processor.stopPreview();
+    }
+
+    void resized() override
+    {
+        const int width = getWidth();
+        search.setBounds(0, 0, width - 250, 20);
+        addButton.setBounds(width - 240, 0, 70, 20);
+        rescanButton.setBounds(width - 160, 0, 60, 20);
+        status.setBounds(width - 95, 0, 95, 20);
+        list.setBounds(0, 25, width, getHeight() - 25);
+    }
+
+    void visibilityChanged() override
+    {
+        if (isVisible()) catalog->rescan();
+        else processor.stopPreview();
+        updateStatus();
+    }
+
+private:
+    int getNumRows() override {return (int) rows.size();}
+
+    void paintListBoxItem(int row, juce::Graphics& g, int width, int height, bool selected) override
+    {
+        if (row < 0 || row >= (int) rows.size()) return;
+        const SampleCatalog::Entry& e = listing->entries[(size_t) rows[(size_t) row]];
+        if (selected) g.fillAll(juce::Colours::darkgrey);
+        g.setColour(juce::Colours::white);
+        g.drawText(e.name, 4, 0, width - 140, height, juce::Justification::centredLeft, true);
+        g.setColour(juce::Colours::lightgrey);
+        const juce::String info = juce::String(e.numChannels) + "ch " + juce::String(e.sampleRate / 1000.0, 1) + "k "
+                                + juce::String(e.getSeconds(), 1) + "s";
+        g.drawText(info, width - 135, 0, 130, height, juce::Justification::centredRight, true);
+    }
+
+    void selectedRowsChanged(int row) override
+    {
+        if (row >= 0 && row < (int) rows.size()) processor.requestPreview(listing->entries[(size_t) rows[(size_t) row]].path);
+    }
+
+    void listBoxItemDoubleClicked(int row, const juce::MouseEvent&) override
+    {
+        if (row < 0 || row >= (int) rows.size()) return;
+        processor.stopPreview();
+        processor.requestLoad(listing->entries[(size_t) rows[(size_t) row]].path);
+    }
+
+    void changeListenerCallback(juce::ChangeBroadcaster*) override
+    {
+        refilter();
+    }
+
+    void refilter()
+    {
+        listing = catalog->getListing();
+        rows = listing->search(search.getText());
+        list.updateContent();
+        list.repaint();
+        updateStatus();
+    }
+
+    void updateStatus()
+    {
+        status.setText(catalog->isScanning() ? "scanning" : juce::String((int) rows.size()) + " files", juce::dontSendNotification);
+    }
+
+    void chooseFolder()
+    {
+        chooser = std::make_unique<juce::FileChooser>("Add a sample folder", juce::File::getSpecialLocation(juce::File::userMusicDirectory));
+        chooser->launchAsync(juce::FileBrowserComponent::openMode | juce::FileBrowserComponent::canSelectDirectories,
+                             [this](const juce::FileChooser& fc){
+                                 const juce::File folder = fc.getResult();
+                                 if (folder.isDirectory()) catalog->addDirectory(folder);
+                                 updateStatus();
+                             });
+    }
+
+    CranulatorAudioProcessor& processor;
+    juce::SharedResourcePointer<SampleCatalog> catalog;
+    SampleCatalog::Listing::Ptr listing;
+    std::vector<int> rows;   //indices into listing->entries
+
+    juce::TextEditor search;
+    juce::TextButton addButton {"add folder"}, rescanButton {"rescan"};
+    juce::Label status;
+    juce::ListBox list;
+    std::unique_ptr<juce::FileChooser> chooser;
+
+    JUCE_DECLARE_NON_COPYABLE (SampleBrowser)
+};
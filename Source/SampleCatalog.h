@@ -0,0 +1,259 @@
+/*
+  ==============================================================================
+
+    SampleCatalog.h
+    Every audio file under the browser's folders, with format, length and rate read from the headers.
+
+  ==============================================================================
+*/
+
+#pragma once
+
+#include <JuceHeader.h>
+#include "ParallelFor.h"
+
+//==============================================================================
+/**
+    The browser shows a Listing, an immutable snapshot of the catalog. It only
+    filters that snapshot in memory, so browsing never touches the disk.
+
+    A rescan walks the folders on a background thread. Headers are read only
+    for files that are new or whose size or modification time changed, split
+    over a pool with one job per core. Every other entry is carried over from
+    the last listing. The result is published as a new listing, saved to the
+    index file and announced through `changed`.
+
+    The index file holds the folders and the listing, so the browser is full
+    as soon as the plugin opens. One catalog is shared by every instance in the
+    process through juce::SharedResourcePointer.
+*/
+class SampleCatalog
+{
+public:
+    struct Entry
+    {
+        juce::String path, name, lowerName;
+        juce::int64 size = 0, modified = 0;
+        juce::String format;
+        int numChannels = 0;   //0 when the header could not be read
+        juce::int64 numSamples = 0;
+        double sampleRate = 0;
+
+        bool isReadable() const {return numChannels > 0 && numSamples > 0 && sampleRate > 0;}
+        double getSeconds() const {return sampleRate > 0 ? (double) numSamples / sampleRate : 0.0;}
+    };
+
+    class Listing : public juce::ReferenceCountedObject
+    {
+    public:
+        typedef juce::ReferenceCountedObjectPtr<Listing> Ptr;
+
+        std::vector<Entry> entries;   //sorted by path
+
+        // the readable entries whose file name contains `text`, in path order
+        std::vector<int> search(const juce::String& text) const{
+            const juce::String lower = text.trim().toLowerCase();
+            std::vector<int> found;
+            for (int i = 0; i < (int) entries.size(); i++){
+                const Entry& e = entries[(size_t) i];
+                if (e.isReadable() && (lower.isEmpty() || e.lowerName.contains(lower))) found.push_back(i);
+            }
+            return found;
+        }
+
+        const Entry* find(const juce::String& path) const{
+            const auto it = std::lower_bound(entries.begin(), entries.end(), path, [](const Entry& e, const juce::String& p){ return e.path < p; });
+            return it != entries.end() && it->path == path ? &*it : nullptr;
+        }
+    };
+
+    SampleCatalog(){
+        load();
+    }
+    ~SampleCatalog(){
+        ++generation;
+        scanner.removeAllJobs(true, 10000);
+    }
+
+    Listing::Ptr getListing() const{
+        const juce::SpinLock::ScopedLockType sl(listingLock);
+        return listing;
+    }
+    juce::StringArray getDirectories() const{
+        const juce::ScopedLock sl(directoryLock);
+        return directories;
+    }
+    void addDirectory(const juce::File& directory){
+        {
+            const juce::ScopedLock sl(directoryLock);
+            if (! directory.isDirectory() || directories.contains(directory.getFullPathName())) return;
+            directories.add(directory.getFullPathName());
+        }
+        rescan();
+    }
+    void removeDirectory(const juce::String& directory){
+        {
+            const juce::ScopedLock sl(directoryLock);
+            directories.removeString(directory);
+        }
+        rescan();
+    }
+
+    // walks every folder again in the background, a newer rescan drops the one in progress
+    void rescan(){
+        const int ticket = ++generation;
+        scanning = true;
+        scanner.addJob([this, ticket]{
+            juce::ThreadPoolJob* job = juce::ThreadPoolJob::getCurrentThreadPoolJob();
+            if (scan([this, job, ticket]{ return ticket != generation.load() || (job != nullptr && job->shouldExit()); })
+                && ticket == generation.load()){
+                scanning = false;
+                changed.sendChangeMessage();
+            }
+        });
+    }
+    bool isScanning() const {return scanning.load();}
+
+    static juce::File getIndexFile(){
+        return juce::File::getSpecialLocation(juce::File::userApplicationDataDirectory).getChildFile("Cranulator").getChildFile("catalog.crncat");
+    }
+
+    // sent on the message thread whenever a new listing is published
+    juce::ChangeBroadcaster changed;
+
+private:
+    static constexpr int magic = 0x434e5243; //"CRNC"
+    static constexpr int version = 1;
+
+    // false when `cancelled` turned true first
+    bool scan(const std::function<bool()>& cancelled){
+        const juce::StringArray folders = getDirectories();
+        juce::AudioFormatManager formats;
+        formats.registerBasicFormats();
+        const juce::String wildcard = formats.getWildcardForAllFormats();
+
+        //the walk only needs what the directory listing already has: name, size and date
+        auto found = std::make_shared<std::vector<Entry>>();
+        for (const juce::String& folder : folders){
+            for (const auto& item : juce::RangedDirectoryIterator(juce::File(folder), true, wildcard, juce::File::findFiles)){
+                if (cancelled()) return false;
+                Entry e;
+                e.path = item.getFile().getFullPathName();
+                e.size = item.getFileSize();
+                e.modified = item.getModificationTime().toMilliseconds();
+                found->push_back(e);
+            }
+        }
+        std::sort(found->begin(), found->end(), [](const Entry& a, const Entry& b){ return a.path < b.path; });
+        //nested folders list the same file twice
+        found->erase(std::unique(found->begin(), found->end(), [](const Entry& a, const Entry& b){ return a.path == b.path; }), found->end());
+
+        const Listing::Ptr previous = getListing();
+        auto stale = std::make_shared<std::vector<size_t>>();
+        for (size_t i = 0; i < found->size(); i++){
+            Entry& e = (*found)[i];
+            const Entry* old = previous != nullptr ? previous->find(e.path) : nullptr;
+            if (old != nullptr && old->size == e.size && old->modified == e.modified) e = *old;
+            else stale->push_back(i);
+        }
+        const bool done = parallelFor(pool, (int) stale->size(), [found, stale](int first, int last){
+            juce::AudioFormatManager headerFormats;
+            headerFormats.registerBasicFormats();
+            for (int k = first; k < last; k++) readHeader((*found)[(*stale)[(size_t) k]], headerFormats);
+        }, cancelled);
+        if (! done) return false;
+
+        Listing::Ptr next = new Listing();
+        next->entries = std::move(*found);
+        {
+            const juce::SpinLock::ScopedLockType sl(listingLock);
+            listing = next;
+        }
+        save(folders, *next);
+        return true;
+    }
+
+    // only the header is parsed, no sample data is read
+    static void readHeader(Entry& e, juce::AudioFormatManager& formats){
+        const juce::File file (e.path);
+        e.name = file.getFileName();
+        e.lowerName = e.name.toLowerCase();
+        std::unique_ptr<juce::AudioFormatReader> reader (formats.createReaderFor(file));
+        if (reader == nullptr) return;
+        e.format = reader->getFormatName();
+        e.numChannels = (int) reader->numChannels;
+        e.numSamples = reader->lengthInSamples;
+        e.sampleRate = reader->sampleRate;
+    }
+
+    //==============================================================================
+    void load(){
+        const juce::File indexFile = getIndexFile();
+        if (! indexFile.existsAsFile()) return;
+        juce::FileInputStream in (indexFile);
+        if (in.failedToOpen() || in.readInt() != magic || in.readInt() != version) return;
+        juce::StringArray folders;
+        const int numFolders = in.readInt();
+        for (int i = 0; i < numFolders && ! in.isExhausted(); i++) folders.add(in.readString());
+        Listing::Ptr loaded = new Listing();
+        const int numEntries = in.readInt();
+        if (numEntries < 0) return;
+        loaded->entries.reserve((size_t) numEntries);
+        for (int i = 0; i < numEntries && ! in.isExhausted(); i++){
+            Entry e;
+            e.path = in.readString();
+            e.size = in.readInt64();
+            e.modified = in.readInt64();
+            e.format = in.readString();
+            e.numChannels = in.readInt();
+            e.numSamples = in.readInt64();
+            e.sampleRate = in.readDouble();
+            e.name = juce::File(e.path).getFileName();
+            e.lowerName = e.name.toLowerCase();
+            loaded->entries.push_back(e);
+        }
+        if ((int) loaded->entries.size() != numEntries) return;
+        directories = folders;
+        listing = loaded;
+    }
+
+    // written to a temporary file first, so a crash never leaves half an index
+    static void save(const juce::StringArray& folders, const Listing& saved){
+        const juce::File indexFile = getIndexFile();
+        indexFile.getParentDirectory().createDirectory();
+        juce::TemporaryFile temp (indexFile);
+        {
+            juce::FileOutputStream out (temp.getFile());
+            if (! out.openedOk()) return;
+            out.writeInt(magic);
+            out.writeInt(version);
+            out.writeInt(folders.size());
+            for (const juce::String& folder : folders) out.writeString(folder);
+            out.writeInt((int) saved.entries.size());
+            for (const Entry& e : saved.entries){
+                out.writeString(e.path);
+                out.writeInt64(e.size);
+                out.writeInt64(e.modified);
+                out.writeString(e.format);
+                out.writeInt(e.numChannels);
+                out.writeInt64(e.numSamples);
+                out.writeDouble(e.sampleRate);
+            }
+            out.flush();
+            if (out.getStatus().failed()) return;
+        }
+        temp.overwriteTargetFileWithTemporary();
+    }
+
+    juce::CriticalSection directoryLock;
+    juce::StringArray directories;
+    Listing::Ptr listing {new Listing()};
+    juce::SpinLock listingLock;
+    std::atomic<int> generation {0};
+    std::atomic<bool> scanning {false};
+    //one thread walks the folders and waits, the other pool reads the headers
+    juce::ThreadPool scanner {1};
+    juce::ThreadPool pool {juce::SystemStats::getNumCpus()};
+
+    JUCE_DECLARE_NON_COPYABLE (SampleCatalog)
+};
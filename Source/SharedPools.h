@@ -0,0 +1,111 @@
+/*
+  ==============================================================================
+
+    SharedPools.h
+    Background threads shared by every instance in the process.
+
+  ==============================================================================
+*/
+
+#pragma once
+
+#include <JuceHeader.h>
+
+//==============================================================================
+/**
+    A session can hold dozens of instances, and most of them sit idle. So no
+    instance owns a thread pool. One set of pools is shared by every instance
+    through juce::SharedResourcePointer, the same way SampleCatalog shares its
+    header pool.
+
+    `background` runs the instances' analysis jobs, one BackgroundQueue each.
+    Those jobs may wait on `parallel`, which spreads one analysis over every
+    core. Nothing on `parallel` ever waits on `background`, so the two cannot
+    deadlock.
+*/
+struct SharedPools
+{
+    juce::ThreadPool background {juce::jmax(2, juce::SystemStats::getNumCpus() / 2)};
+    juce::ThreadPool parallel {juce::SystemStats::getNumCpus()};
+};
+
+//==============================================================================
+/**
+    One instance's jobs on the shared background pool, run one at a time in
+    the order they were added. That is how they ran on the instance's own
+    single-thread pool, so jobs that share state need no lock between them.
+
+    A running job can ask juce::ThreadPoolJob::getCurrentThreadPoolJob() if
+    it should exit, as before. clear() only touches this queue's jobs, not
+    other instances' jobs.
+*/
+class BackgroundQueue
+{
+public:
+    BackgroundQueue() = default;
+    ~BackgroundQueue() {clear(5000);}
+
+    void add(std::function<void()> job){
+        const juce::ScopedLock sl(lock);
+        jobs.push_back(std::move(job));
+        if (running) return;
+        running = true;
+        pools->background.addJob(new Runner(*this), true);
+    }
+
+    // drops the jobs that haven't started and waits for the running one, which is told to exit
+    void clear(int timeOutMs){
+        {
+            const juce::ScopedLock sl(lock);
+            jobs.clear();
+        }
+        Selector selector (*this);
+        pools->background.removeAllJobs(true, timeOutMs, &selector);
+        //a runner removed before it started never got to say so
+        const juce::ScopedLock sl(lock);
+        running = false;
+    }
+
+    juce::ThreadPool& getParallelPool() {return pools->parallel;}
+
+private:
+    struct Runner : public juce::ThreadPoolJob
+    {
+        explicit Runner(BackgroundQueue& q) : juce::ThreadPoolJob("Cranulator background"), queue(q) {}
+
+        JobStatus runJob() override{
+            for (;;){
+                std::function<void()> job;
+                {
+                    const juce::ScopedLock sl(queue.lock);
+                    if (shouldExit() || queue.jobs.empty()){
+                        queue.running = false;
+                        return jobHasFinished;
+                    }
+                    job = std::move(queue.jobs.front());
+                    queue.jobs.erase(queue.jobs.begin());
+                }
+                job();
+            }
+        }
+
+        BackgroundQueue& queue;
+    };
+
+    struct Selector : public juce::ThreadPool::JobSelector
+    {
+        explicit Selector(BackgroundQueue& q) : queue(q) {}
+        bool isJobSuitable(juce::ThreadPoolJob* job) override{
+            const Runner* runner = dynamic_cast<Runner*> (job);
+            return runner != nullptr && &runner->queue == &queue;
+        }
+        BackgroundQueue& queue;
+    };
+
+    juce::SharedResourcePointer<SharedPools> pools;
+    juce::CriticalSection lock;
+    std::vector<std::function<void()>> jobs;   //a handful at most, oldest first
+    bool running = false;
+
+    JUCE_DECLARE_NON_COPYABLE (BackgroundQueue)
+};
@@ -0,0 +1,371 @@
+/*
+  ==============================================================================
+
+    SourceIndex.h
+    Per-frame loudness, brightness, onsets and pitch of a loaded file, cached next to it.
+
+  ==============================================================================
+*/
+
+#pragma once
+
+#include <JuceHeader.h>
+#include "ReferenceCountedBuffer.h"
+#include "ParallelFor.h"
+
+//==============================================================================
+/**
+    One entry per `hop` samples of the file (all channels mixed down):
+
+    - RMS over the hop.
+    - Spectral centroid, 0 to 1 of Nyquist.
+    - Whether an onset starts there, picked from the spectral flux.
+    - The pitch period in samples (YIN, 50 Hz to 1 kHz), 0 where there is no
+      clear pitch.
+
+    It also holds pitch marks: one sample per period through every pitched
+    stretch, each on the period's largest peak. Pitch-synchronous grains are
+    centred on them.
+
+    The frames are analysed in parallel. Onsets and marks are picked in one
+    pass after. The result is written to `<file>.crnidx` next to the audio, and is
+    read back instead of analysed whenever the file's size, date and length
+    still match.
+
+    Placement never searches. For every frame the index keeps the next
+    audible frame, the next onset (both wrapping round the end) and its first
+    pitch mark. Moving a grain's start is one table lookup on the audio
+    thread, plus a step over the few marks inside one frame.
+*/
+class SourceIndex : public juce::ReferenceCountedObject
+{
+public:
+    typedef juce::ReferenceCountedObjectPtr<SourceIndex> Ptr;
+
+    enum Placement {free, skipSilence, onsets};
+    static juce::StringArray getPlacementNames() {return {"free", "skip silence", "onsets"};}
+
+    static constexpr int hop = 512;
+    static constexpr int fftOrder = 10;
+    static constexpr int fftSize = 1 << fftOrder;
+    static constexpr float silenceDecibels = -40.0f;   //relative to the loudest frame
+    static constexpr float minPitch = 50.0f, maxPitch = 1000.0f;
+    static constexpr int pitchWindow = 1024;
+    static constexpr int pitchOrder = 12;              //fits the window plus the longest lag
+
+    SourceIndex(ReferenceCountedBuffer::Ptr file, double fileSampleRate):
+    source(file), sampleRate(fileSampleRate), numFrames(juce::jmax(1, (file->getNumSamples() + hop - 1) / hop)),
+    minLag(juce::jmax(2, (int) (sampleRate / maxPitch))), maxLag(juce::jlimit(minLag + 1, (1 << pitchOrder) - pitchWindow - 1, (int) (sampleRate / minPitch))),
+    rms((size_t) numFrames), centroid((size_t) numFrames), flux((size_t) numFrames), period((size_t) numFrames), onset((size_t) numFrames),
+    nextAudible((size_t) numFrames), nextOnset((size_t) numFrames), firstMark((size_t) numFrames)
+    {}
+
+    /** Reads the sidecar of audioFile, or analyses file on pool and writes one.
+        Returns null when `cancelled` turns true before the analysis is done.
+    */
+    static Ptr build(ReferenceCountedBuffer::Ptr file, double sampleRate, const juce::File& audioFile, juce::ThreadPool& pool, const std::function<bool()>& cancelled){
+        Ptr index = new SourceIndex(file, sampleRate);
+        const juce::File sidecar = getSidecar(audioFile);
+        if (! index->read(sidecar, audioFile)){
+            if (! parallelFor(pool, index->numFrames, [index](int first, int last){ index->analyse(first, last); }, cancelled)) return nullptr;
+            index->findOnsets();
+            index->findMarks();
+            index->write(sidecar, audioFile);
+        }
+        index->buildLookups();
+        return index;
+    }
+
+    static juce::File getSidecar(const juce::File& audioFile) {return audioFile.getSiblingFile(audioFile.getFileName() + ".crnidx");}
+
+    const ReferenceCountedBuffer* getSource() const {return source.get();}
+    int getNumFrames() const {return numFrames;}
+    float getRms(int frame) const {return rms[(size_t) frame];}
+    float getCentroid(int frame) const {return centroid[(size_t) frame];}
+    bool isOnset(int frame) const {return onset[(size_t) frame] != 0;}
+    int getNumMarks() const {return (int) marks.size();}
+    int getMark(int i) const {return marks[(size_t) i];}
+
+    // pitch period around `sample` in samples, 0 where the file has no clear pitch
+    float periodAt(int sample) const {return period[(size_t) juce::jlimit(0, numFrames - 1, sample / hop)];}
+
+    // the pitch mark closest to `sample`, -1 when there is none
+    int nearestMark(int sample) const{
+        if (marks.empty()) return -1;
+        size_t i = (size_t) firstMark[(size_t) juce::jlimit(0, numFrames - 1, sample / hop)];
+        while (i < marks.size() && marks[i] < sample) i++;
+        if (i == marks.size()) return marks.back();
+        if (i == 0 || marks[i] - sample < sample - marks[i - 1]) return marks[i];
+        return marks[i - 1];
+    }
+
+    // where a grain meant to start at `sample` starts instead
+    int place(int sample, int placement) const{
+        if (placement == free) return sample;
+        const int frame = juce::jlimit(0, numFrames - 1, sample / hop);
+        if (placement == onsets){
+            const int target = nextOnset[(size_t) frame];
+            return target < 0 ? sample : target * hop;
+        }
+        const int target = nextAudible[(size_t) frame];
+        return target < 0 || target == frame ? sample : target * hop;
+    }
+
+private:
+    static constexpr int magic = 0x584e5243; //"CRNX"
+    static constexpr int version = 2;
+
+    // frames [first, last), each job with its own FFT
+    void analyse(int first, int last){
+        const int numBins = fftSize / 2 + 1;
+        const int numChannels = source->getNumChannels();
+        juce::dsp::FFT fft (fftOrder);
+        std::vector<float> window ((size_t) fftSize), mix ((size_t) fftSize), channel ((size_t) fftSize), data ((size_t) fftSize * 2);
+        std::vector<float> previous ((size_t) numBins), current ((size_t) numBins);
+        PitchTracker pitch (*this);
+        for (int i = 0; i < fftSize; i++)
+            window[(size_t) i] = 0.5f - 0.5f * std::cos(juce::MathConstants<float>::twoPi * (float) i / (float) fftSize);
+
+        //the frame before the range is only transformed for the flux
+        for (int j = first - 1; j < last; j++){
+            const juce::int64 start = (juce::int64) j * hop + hop / 2 - fftSize / 2;
+            std::fill(mix.begin(), mix.end(), 0.0f);
+            for (int c = 0; c < numChannels; c++){
+                source->readCircular(c, start, channel.data(), fftSize);
+                juce::FloatVectorOperations::add(mix.data(), channel.data(), fftSize);
+            }
+            if (numChannels > 1) juce::FloatVectorOperations::multiply(mix.data(), 1.0f / (float) numChannels, fftSize);
+
+            if (j >= first){
+                float sum = 0;
+                for (int i = (fftSize - hop) / 2; i < (fftSize + hop) / 2; i++) sum += mix[(size_t) i] * mix[(size_t) i];
+                rms[(size_t) j] = std::sqrt(sum / (float) hop);
+            }
+
+            std::copy(mix.begin(), mix.end(), data.begin());
+            juce::FloatVectorOperations::multiply(data.data(), window.data(), fftSize);
+            fft.performRealOnlyForwardTransform(data.data(), true);
+            float weighted = 0, total = 0, rise = 0;
+            for (int b = 0; b < numBins; b++){
+                const float re = data[(size_t) (2 * b)], im = data[(size_t) (2 * b + 1)];
+                const float m = std::sqrt(re * re + im * im);
+                weighted += (float) b * m;
+                total += m;
+                //log-compressed, so quiet attacks count as well as loud ones
+                current[(size_t) b] = std::log1p(100.0f * m);
+                rise += juce::jmax(0.0f, current[(size_t) b] - previous[(size_t) b]);
+            }
+            if (j >= first){
+                centroid[(size_t) j] = total > 0 ? weighted / (total * (float) (numBins - 1)) : 0.0f;
+                flux[(size_t) j] = rise;
+                period[(size_t) j] = pitch.periodAt((juce::int64) j * hop + hop / 2 - pitchWindow / 2);
+            }
+            std::swap(previous, current);
+        }
+    }
+
+    //==============================================================================
+    // YIN over one window, the difference function worked out from an FFT cross-correlation
+    struct PitchTracker
+    {
+        explicit PitchTracker(const SourceIndex& owner) : index(owner), fft(pitchOrder),
+        x ((size_t) size), a ((size_t) size * 2), b ((size_t) size * 2), channel ((size_t) size), d ((size_t) owner.maxLag + 1), energy ((size_t) size + 1)
+        {}
+
+        float periodAt(juce::int64 start){
+            const int length = pitchWindow + index.maxLag;
+            const int numChannels = index.source->getNumChannels();
+            std::fill(x.begin(), x.end(), 0.0f);
+            for (int c = 0; c < numChannels; c++){
+                index.source->readCircular(c, start, channel.data(), length);
+                juce::FloatVectorOperations::add(x.data(), channel.data(), length);
+            }
+            for (int i = 0; i < length; i++) energy[(size_t) i + 1] = energy[(size_t) i] + x[(size_t) i] * x[(size_t) i];
+            if (energy[(size_t) pitchWindow] <= 1.0e-8f) return 0;
+
+            //r(tau) = sum over the window of x[t] * x[t + tau]
+            std::fill(a.begin(), a.end(), 0.0f);
+            std::copy(x.begin(), x.begin() + pitchWindow, a.begin());
+            std::copy(x.begin(), x.end(), b.begin());
+            std::fill(b.begin() + size, b.end(), 0.0f);
+            fft.performRealOnlyForwardTransform(a.data(), true);
+            fft.performRealOnlyForwardTransform(b.data(), true);
+            for (int k = 0; k <= size / 2; k++){
+                const float ar = a[(size_t) (2 * k)], ai = a[(size_t) (2 * k + 1)];
+                const float br = b[(size_t) (2 * k)], bi = b[(size_t) (2 * k + 1)];
+                a[(size_t) (2 * k)] = ar * br + ai * bi;
+                a[(size_t) (2 * k + 1)] = ar * bi - ai * br;
+            }
+            fft.performRealOnlyInverseTransform(a.data());
+
+            //cumulative mean normalised difference, the first dip under the threshold is the period
+            const float threshold = 0.15f;
+            float sum = 0;
+            int found = -1;
+            d[0] = 1;
+            for (int tau = 1; tau <= index.maxLag; tau++){
+                const float e = energy[(size_t) pitchWindow] + energy[(size_t) (tau + pitchWindow)] - energy[(size_t) tau];
+                const float diff = juce::jmax(0.0f, e - 2.0f * a[(size_t) tau]);
+                sum += diff;
+                d[(size_t) tau] = sum > 0 ? diff * (float) tau / sum : 1.0f;
+                if (found < 0 && tau > index.minLag && d[(size_t) tau] > d[(size_t) tau - 1] && d[(size_t) tau - 1] < threshold) found = tau - 1;
+            }
+            if (found < 0 || found >= index.maxLag) return 0;
+            //parabola through the dip and its neighbours
+            const float y0 = d[(size_t) found - 1], y1 = d[(size_t) found], y2 = d[(size_t) found + 1];
+            const float denominator = y0 - 2.0f * y1 + y2;
+            //kept inside the searched lags, which is what read() accepts back from a sidecar
+            return juce::jlimit((float) index.minLag, (float) index.maxLag, (float) found + (denominator > 0 ? 0.5f * (y0 - y2) / denominator : 0.0f));
+        }
+
+        static constexpr int size = 1 << pitchOrder;
+        const SourceIndex& index;
+        juce::dsp::FFT fft;
+        std::vector<float> x, a, b, channel, d, energy;
+    };
+
+    // peaks of the flux that stand out from their neighbourhood, at least minGap frames apart
+    void findOnsets(){
+        const int radius = 8, minGap = 4;
+        std::vector<double> prefix ((size_t) numFrames + 1, 0.0);
+        for (int j = 0; j < numFrames; j++) prefix[(size_t) j + 1] = prefix[(size_t) j] + flux[(size_t) j];
+        const double globalMean = prefix[(size_t) numFrames] / numFrames;
+        int last = -minGap;
+        for (int j = 0; j < numFrames; j++){
+            onset[(size_t) j] = 0;
+            const float f = flux[(size_t) j];
+            if (j > 0 && f <= flux[(size_t) j - 1]) continue;
+            if (j < numFrames - 1 && f < flux[(size_t) j + 1]) continue;
+            const int a = juce::jmax(0, j - radius), b = juce::jmin(numFrames, j + radius + 1);
+            const double localMean = (prefix[(size_t) b] - prefix[(size_t) a]) / (b - a);
+            if (f > 1.5 * localMean + 0.1 * globalMean && j - last >= minGap){
+                onset[(size_t) j] = 1;
+                last = j;
+            }
+        }
+    }
+
+    // one mark per period through every pitched stretch, each on the largest peak near where the last period predicts
+    void findMarks(){
+        //a pitch found in near silence is only noise
+        const float peak = *std::max_element(rms.begin(), rms.end());
+        const float threshold = peak * juce::Decibels::decibelsToGain(silenceDecibels);
+        for (int j = 0; j < numFrames; j++)
+            if (rms[(size_t) j] <= threshold) period[(size_t) j] = 0;
+
+        marks.clear();
+        const int numSamples = source->getNumSamples();
+        const int numChannels = source->getNumChannels();
+        std::vector<float> mix ((size_t) maxLag * 2), channel ((size_t) maxLag * 2);
+        int last = -1, t = 0;
+        while (t < numSamples){
+            const float p = periodAt(t);
+            if (p <= 0){
+                last = -1;
+                t = (t / hop + 1) * hop;
+                continue;
+            }
+            const int length = (int) p;
+            const int from = last < 0 ? t : last + length - length / 4;
+            const int to = juce::jmin(numSamples, last < 0 ? t + length : last + length + length / 4 + 1);
+            if (from >= to) break;
+            std::fill(mix.begin(), mix.end(), 0.0f);
+            for (int c = 0; c < numChannels; c++){
+                source->readCircular(c, from, channel.data(), to - from);
+                juce::FloatVectorOperations::add(mix.data(), channel.data(), to - from);
+            }
+            const int mark = from + (int) (std::max_element(mix.begin(), mix.begin() + (to - from)) - mix.begin());
+            marks.push_back(mark);
+            last = mark;
+            t = mark + 1;
+        }
+    }
+
+    // the next audible frame and the next onset from every frame, both wrapping round the end
+    void buildLookups(){
+        const float peak = *std::max_element(rms.begin(), rms.end());
+        const float threshold = peak * juce::Decibels::decibelsToGain(silenceDecibels);
+        int audible = -1, hit = -1;
+        for (int i = 2 * numFrames - 1; i >= 0; i--){
+            const int j = i % numFrames;
+            if (rms[(size_t) j] > threshold) audible = j;
+            if (onset[(size_t) j] != 0) hit = j;
+            if (i < numFrames){
+                nextAudible[(size_t) j] = audible;
+                nextOnset[(size_t) j] = hit;
+            }
+        }
+        size_t m = 0;
+        for (int j = 0; j < numFrames; j++){
+            while (m < marks.size() && marks[m] < j * hop) m++;
+            firstMark[(size_t) j] = (int) m;
+        }
+    }
+
+    //==============================================================================
+    // false for a missing, stale or corrupt sidecar, which is then analysed again
+    bool read(const juce::File& sidecar, const juce::File& audioFile){
+        if (! sidecar.existsAsFile() || ! audioFile.existsAsFile()) return false;
+        juce::FileInputStream in (sidecar);
+        if (in.failedToOpen()) return false;
+        if (in.readInt() != magic || in.readInt() != version
+            || in.readInt() != source->getNumChannels() || in.readInt() != source->getNumSamples()
+            || in.readInt() != hop || in.readInt() != numFrames || in.readInt() != (int) sampleRate
+            || in.readInt64() != audioFile.getSize() || in.readInt64() != audioFile.getLastModificationTime().toMilliseconds())
+            return false;
+        for (float& x : rms) x = in.readFloat();
+        for (float& x : centroid) x = in.readFloat();
+        for (juce::uint8& x : onset) x = (juce::uint8) in.readByte();
+        for (float& x : period){
+            x = in.readFloat();
+            //grain lengths and onsets are worked out from the period, so only what the analysis can produce gets through (NaN fails too)
+            if (x != 0 && ! (x >= (float) minLag && x <= (float) maxLag)) return false;
+        }
+        const int numMarks = in.readInt();
+        if (numMarks < 0 || numMarks > source->getNumSamples()) return false;
+        marks.resize((size_t) numMarks);
+        for (size_t i = 0; i < marks.size(); i++){
+            marks[i] = in.readInt();
+            //nearestMark walks forward from firstMark, so the marks have to be in order and inside the file
+            if (marks[i] < 0 || marks[i] >= source->getNumSamples() || (i > 0 && marks[i] <= marks[i - 1])) return false;
+        }
+        return in.getPosition() == in.getTotalLength();
+    }
+
+    // written to a temporary file first, so a sidecar is never half there; a folder we can't write to just means analysing again
+    void write(const juce::File& sidecar, const juce::File& audioFile) const{
+        if (! audioFile.existsAsFile()) return;
+        juce::TemporaryFile temp (sidecar);
+        {
+            juce::FileOutputStream out (temp.getFile());
+            if (! out.openedOk()) return;
+            out.writeInt(magic);
+            out.writeInt(version);
+            out.writeInt(source->getNumChannels());
+            out.writeInt(source->getNumSamples());
+            out.writeInt(hop);
+            out.writeInt(numFrames);
+            out.writeInt((int) sampleRate);
+            out.writeInt64(audioFile.getSize());
+            out.writeInt64(audioFile.getLastModificationTime().toMilliseconds());
+            for (float x : rms) out.writeFloat(x);
+            for (float x : centroid) out.writeFloat(x);
+            for (juce::uint8 x : onset) out.writeByte((char) x);
+            for (float x : period) out.writeFloat(x);
+            out.writeInt((int) marks.size());
+            for (int x : marks) out.writeInt(x);
+            out.flush();
+            if (out.getStatus().failed()) return;
+        }
+        temp.overwriteTargetFileWithTemporary();
+    }
+
+    ReferenceCountedBuffer::Ptr source;
+    const double sampleRate;
+    const int numFrames;
+    const int minLag, maxLag;   //pitch periods searched, in samples
+    std::vector<float> rms, centroid, flux, period;
+    std::vector<juce::uint8> onset;
+    std::vector<int> marks;
+    std::vector<int> nextAudible, nextOnset, firstMark;
+};
@@ -0,0 +1,165 @@
+/*
+  ==============================================================================
+
+    Spatializer.h
+    Per-grain pan gains for mono, stereo, speaker rings and first-order ambisonics.
+
+  ==============================================================================
+*/
+
+#pragma once
+
+#include <JuceHeader.h>
+
+//==============================================================================
+// The output channels one grain feeds and the gains it uses, worked out once when
+// the grain is scheduled. A grain with no routes falls back to the old
+// `channel % numSourceChannels` mapping.
+struct SpatialRoutes
+{
+    struct Route
+    {
+        juce::uint8 src, dst;
+        float gain;
+    };
+    static constexpr int maxRoutes = 8; //two sources, at most four outputs each
+
+    Route route[maxRoutes];
+    int numRoutes = 0;
+
+    void add(int src, int dst, float gain){
+        if (std::abs(gain) < 1.0e-5f || numRoutes == maxRoutes) return;
+        route[numRoutes++] = {(juce::uint8) src, (juce::uint8) dst, gain};
+    }
+};
+
+//==============================================================================
+/**
+    Knows where each output channel sits and turns a grain's azimuth into
+    routes. Azimuths are in radians: 0 is front and positive is to the right.
+    The pan knob covers -pi/2 to pi/2. Spread can push grains all the way round.
+
+    - Stereo uses a sin/cos law on the left-right component.
+    - Speaker rings (quad, 5.1, 7.1) pan between the two speakers on either
+      side of the grain with constant power. LFE is left out.
+    - First-order ambisonics (ACN/SN3D) encodes W, Y and X. Grains stay on the
+      horizontal plane, so Z is never fed.
+
+    A stereo source becomes two sources, `width` * pi/2 either side of the
+    grain. Speaker gains are scaled so a centred mono file plays at the level
+    it had on a stereo bus, and a stereo file at full width plays exactly as
+    before.
+*/
+class SpeakerLayout
+{
+public:
+    SpeakerLayout() : SpeakerLayout(juce::AudioChannelSet::stereo()) {}
+
+    explicit SpeakerLayout(const juce::AudioChannelSet& set)
+    {
+        numChannels = set.size();
+        if (numChannels == 1) kind = Kind::mono;
+        else if (set == juce::AudioChannelSet::stereo()) kind = Kind::stereo;
+        else if (set.getAmbisonicOrder() == 1) kind = Kind::ambisonic;
+        else{
+            for (int i = 0; i < numChannels && numSpeakers < maxSpeakers; i++){
+                float az;
+                if (azimuthOf(set.getTypeOfChannel(i), az)) speakers[numSpeakers++] = {az, i};
+            }
+            std::sort(speakers, speakers + numSpeakers, [](const Speaker& a, const Speaker& b){ return a.azimuth < b.azimuth; });
+            kind = numSpeakers >= 2 ? Kind::ring : Kind::direct;
+        }
+    }
+
+    // routes for a grain centred at `azimuth`, empty when the layout or the file has to use the old mapping
+    SpatialRoutes routesFor(float azimuth, float width, int numSources) const
+    {
+        SpatialRoutes routes;
+        if (numSources < 1 || numSources > 2 || kind == Kind::direct) return routes;
+        const float halfWidth = width * juce::MathConstants<float>::halfPi;
+        const float norm = std::sqrt(2.0f / (float) numSources);
+        for (int s = 0; s < numSources; s++){
+            const float az = numSources == 1 ? azimuth : azimuth + (s == 0 ? -halfWidth : halfWidth);
+            switch (kind){
+                case Kind::mono:
+                    routes.add(s, 0, 1.0f / (float) numSources);
+                    break;
+                case Kind::stereo:{
+                    const float theta = (juce::jlimit(-1.0f, 1.0f, std::sin(az)) + 1.0f) * juce::MathConstants<float>::pi * 0.25f;
+                    routes.add(s, 0, norm * std::cos(theta));
+                    routes.add(s, 1, norm * std::sin(theta));
+                    break;
+                }
+                case Kind::ring:
+                    addRingRoutes(routes, s, wrapAzimuth(az), norm);
+                    break;
+                case Kind::ambisonic:
+                    //ACN order W, Y, Z, X; ambisonic azimuth turns to the left
+                    routes.add(s, 0, 1.0f);
+                    routes.add(s, 1, -std::sin(az));
+                    routes.add(s, 3, std::cos(az));
+                    break;
+                default: break;
+            }
+        }
+        return routes;
+    }
+
+private:
+    enum class Kind {mono, stereo, ring, ambisonic, direct};
+    struct Speaker
+    {
+        float azimuth;
+        int channel;
+    };
+    static constexpr int maxSpeakers = 16;
+
+    static bool azimuthOf(juce::AudioChannelSet::ChannelType type, float& az)
+    {
+        float degrees;
+        switch (type){
+            case juce::AudioChannelSet::left: degrees = -30; break;
+            case juce::AudioChannelSet::right: degrees = 30; break;
+            case juce::AudioChannelSet::centre: degrees = 0; break;
+            case juce::AudioChannelSet::leftSurround: degrees = -110; break;
+            case juce::AudioChannelSet::rightSurround: degrees = 110; break;
+            case juce::AudioChannelSet::leftSurroundSide: degrees = -90; break;
+            case juce::AudioChannelSet::rightSurroundSide: degrees = 90; break;
+            case juce::AudioChannelSet::leftSurroundRear: degrees = -150; break;
+            case juce::AudioChannelSet::rightSurroundRear: degrees = 150; break;
+            case juce::AudioChannelSet::surround: degrees = 180; break;
+            default: return false; //LFE and anything without a place on the ring
+        }
+        az = juce::degreesToRadians(degrees);
+        return true;
+    }
+
+    static float wrapAzimuth(float az)
+    {
+        const float twoPi = juce::MathConstants<float>::twoPi;
+        az = std::fmod(az + juce::MathConstants<float>::pi, twoPi);
+        if (az < 0) az += twoPi;
+        return az - juce::MathConstants<float>::pi;
+    }
+
+    // constant power between the pair of speakers either side of az, wrapping from the last one to the first
+    void addRingRoutes(SpatialRoutes& routes, int src, float az, float norm) const
+    {
+        int next = 0;
+        while (next < numSpeakers && speakers[next].azimuth <= az) next++;
+        const Speaker& a = speakers[(next + numSpeakers - 1) % numSpeakers];
+        const Speaker& b = speakers[next % numSpeakers];
+        float span = b.azimuth - a.azimuth;
+        float offset = az - a.azimuth;
+        if (span <= 0) span += juce::MathConstants<float>::twoPi;
+        if (offset < 0) offset += juce::MathConstants<float>::twoPi;
+        const float t = juce::jlimit(0.0f, 1.0f, offset / span) * juce::MathConstants<float>::halfPi;
+        routes.add(src, a.channel, norm * std::cos(t));
+        routes.add(src, b.channel, norm * std::sin(t));
+    }
+
+    Kind kind = Kind::stereo;
+    int numChannels = 2;
+    Speaker speakers[maxSpeakers];
+    int numSpeakers = 0;
+};
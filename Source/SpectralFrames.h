@@ -0,0 +1,152 @@
+/*
+  ==============================================================================
+
+    SpectralFrames.h
+    Short-time Fourier transform of a loaded file, worked out once in the background.
+
+  ==============================================================================
+*/
+
+#pragma once
+
+#include <JuceHeader.h>
+#include "ReferenceCountedBuffer.h"
+#include "ParallelFor.h"
+
+//==============================================================================
+/**
+    Magnitude and instantaneous frequency of every channel of a file, one frame
+    every `hop` samples. Frame j is centred on sample j * hop and reads the file
+    circularly, the same way the grains do. Frames are analysed zero-phase, so
+    the bins around a partial share its phase.
+
+    Spectral grains only ever run inverse transforms and overlap-add on these
+    frames. Each bin's frequency already holds the phase advance measured
+    between neighbouring frames, so a grain can resynthesise a frame at any
+    pitch without going back to the audio.
+
+    A bin is stored in four bytes: its magnitude on a log scale and its phase
+    deviation from the bin's centre, 16 bits each. That is still twice the
+    file's own float samples, so the frames come from the SampleArena, count in
+    its stats, and a file whose frames would pass maxBytes gets none.
+
+    The frames are split into one range per core and transformed on a thread
+    pool. Each range has its own FFT and scratch, so the jobs share nothing but
+    the read-only file. The object keeps its file alive, so a spectrum always
+    matches the buffer it was built from.
+*/
+class SpectralFrames : public juce::ReferenceCountedObject
+{
+public:
+    typedef juce::ReferenceCountedObjectPtr<SpectralFrames> Ptr;
+
+    static constexpr int order = 11;
+    static constexpr int size = 1 << order;
+    static constexpr int hop = size / 4;
+    static constexpr int numBins = size / 2 + 1;
+    //about six minutes of stereo at 48 kHz
+    static constexpr juce::int64 maxBytes = (juce::int64) 256 * 1024 * 1024;
+
+    struct Bin
+    {
+        juce::uint16 magnitude;   //0 is silence, then magnitudeStepsPerOctave steps per octave up from 2^minMagnitudeOctave
+        juce::int16 deviation;    //phase advance over one hop beyond the bin's centre frequency, full scale is pi
+    };
+
+    explicit SpectralFrames(ReferenceCountedBuffer::Ptr file):
+    source(file), numChannels(file->getNumChannels()), numFrames(numFramesFor(*file)),
+    bins(arena->allocate((size_t) bytesFor(*file)))
+    {}
+
+    // what the frames of file would take, whether or not that is under maxBytes
+    static juce::int64 bytesFor(const ReferenceCountedBuffer& file){
+        return (juce::int64) file.getNumChannels() * numFramesFor(file) * numBins * (juce::int64) sizeof(Bin);
+    }
+
+    /** Builds the spectrum of file on pool, one job per thread, and waits for it.
+        Returns null when `cancelled` turns true before the jobs are done, or
+        when the file is too long for maxBytes.
+    */
+    static Ptr build(ReferenceCountedBuffer::Ptr file, juce::ThreadPool& pool, const std::function<bool()>& cancelled){
+        if (bytesFor(*file) > maxBytes) return nullptr;
+        Ptr frames = new SpectralFrames(file);
+        const bool done = parallelFor(pool, frames->numFrames, [frames](int first, int last){ frames->analyse(first, last); }, cancelled);
+        return done ? frames : nullptr;
+    }
+
+    const ReferenceCountedBuffer* getSource() const {return source.get();}
+    int getNumChannels() const {return numChannels;}
+    int getNumFrames() const {return numFrames;}
+    // numBins of them, read with magnitudeOf and frequencyOf
+    const Bin* getBins(int channel, int frame) const {return static_cast<const Bin*> (bins->getData()) + offsetOf(channel, frame);}
+
+    // linear magnitude
+    static float magnitudeOf(Bin bin){
+        if (bin.magnitude == 0) return 0.0f;
+        return std::exp2((float) (bin.magnitude - 1) / magnitudeStepsPerOctave + (float) minMagnitudeOctave);
+    }
+    // radians per sample of bin number b
+    static float frequencyOf(Bin bin, int b){
+        return (centreAdvance(b) + (float) bin.deviation * (juce::MathConstants<float>::pi / 32767.0f)) / (float) hop;
+    }
+
+private:
+    //2^-40 is far below anything audible, 64 octaves up covers a full-scale sine with room to spare
+    static constexpr int minMagnitudeOctave = -40;
+    static constexpr float magnitudeStepsPerOctave = 1024.0f;
+
+    static int numFramesFor(const ReferenceCountedBuffer& file) {return juce::jmax(1, (file.getNumSamples() + hop - 1) / hop);}
+    size_t offsetOf(int channel, int frame) const {return ((size_t) channel * (size_t) numFrames + (size_t) frame) * numBins;}
+
+    // the phase a partial at bin b's centre frequency advances over one hop
+    static float centreAdvance(int b) {return juce::MathConstants<float>::twoPi * (float) b * (float) hop / (float) size;}
+
+    static Bin encode(float magnitude, float deviation){
+        Bin bin;
+        const float steps = (std::log2(magnitude) - (float) minMagnitudeOctave) * magnitudeStepsPerOctave;
+        bin.magnitude = magnitude > 0.0f && steps >= 0.0f ? (juce::uint16) juce::jmin(65535.0f, steps + 1.5f) : 0;
+        bin.deviation = (juce::int16) juce::roundToInt(juce::jlimit(-32767.0f, 32767.0f, deviation * (32767.0f / juce::MathConstants<float>::pi)));
+        return bin;
+    }
+
+    // frames [first, last) of every channel
+    void analyse(int first, int last){
+        juce::dsp::FFT fft (order);
+        std::vector<float> window ((size_t) size), data ((size_t) size * 2), previous ((size_t) numBins);
+        for (int i = 0; i < size; i++)
+            window[(size_t) i] = 0.5f - 0.5f * std::cos(juce::MathConstants<float>::twoPi * (float) i / (float) size);
+
+        for (int c = 0; c < numChannels; c++){
+            //the frame before the range is only transformed for its phases
+            for (int j = first - 1; j < last; j++){
+                source->readCircular(c, (juce::int64) j * hop - size / 2, data.data(), size);
+                juce::FloatVectorOperations::multiply(data.data(), window.data(), size);
+                //zero phase: the frame's centre goes to sample 0, so every bin under a partial's main lobe has the partial's phase
+                std::rotate(data.begin(), data.begin() + size / 2, data.begin() + size);
+                fft.performRealOnlyForwardTransform(data.data(), true);
+
+                Bin* out = j >= first ? static_cast<Bin*> (bins->getData()) + offsetOf(c, j) : nullptr;
+                for (int b = 0; b < numBins; b++){
+                    const float re = data[(size_t) (2 * b)], im = data[(size_t) (2 * b + 1)];
+                    const float phase = std::atan2(im, re);
+                    if (out != nullptr){
+                        //the phase advance over one hop, minus what the bin's centre frequency accounts for
+                        const float deviation = wrapPhase(phase - previous[(size_t) b] - centreAdvance(b));
+                        out[b] = encode(std::sqrt(re * re + im * im), deviation);
+                    }
+                    previous[(size_t) b] = phase;
+                }
+            }
+        }
+    }
+
+    static float wrapPhase(float x){
+        return x - juce::MathConstants<float>::twoPi * std::floor(x / juce::MathConstants<float>::twoPi + 0.5f);
+    }
+
+    ReferenceCountedBuffer::Ptr source;
+    const int numChannels;
+    const int numFrames;
+    juce::SharedResourcePointer<SampleArena> arena;
+    std::unique_ptr<SampleArena::Block> bins;
+};
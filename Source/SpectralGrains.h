@@ -0,0 +1,206 @@
+/*
+  ==============================================================================
+
+    SpectralGrains.h
+    Grains resynthesised from the spectral frames of the file.
+
+  ==============================================================================
+*/
+
+#pragma once
+
+#include <JuceHeader.h>
+#include "Grain.h"
+#include "SpectralFrames.h"
+
+//==============================================================================
+/**
+    A spectral grain walks through the file's frames at the file's own speed
+    and shifts every frame by the grain's rate. Its pitch changes but its
+    timing does not, and a grain started at one position keeps its pitch for as
+    long as it lasts.
+
+    Each grain keeps a running phase per bin and an overlap-add ring one frame
+    long. A frame is resynthesised (one inverse FFT per source channel) just
+    before the first output sample it covers, so the grain sounds the same
+    whatever the block size. Frames are laid out so that every output sample,
+    from the grain's first one on, sits under four of them.
+
+    Timing, envelope, culling and routing come from a Grain built as usual,
+    so a spectral grain is shaped and panned exactly like a time-domain one.
+    They are far more expensive, so there are only `capacity` of them and a
+    spawn with no free slot is dropped. Only the first maxSources source
+    channels are resynthesised.
+*/
+class SpectralGrains
+{
+public:
+    static constexpr int capacity = 64;
+    static constexpr int maxSources = 2;
+
+    SpectralGrains() : slots(new Slot[capacity]) {}
+
+    // builds a grain with the usual Grain arguments, false when every slot is taken or the grain is culled
+    template <typename... Args>
+    bool spawn(Args&&... args)
+    {
+        if (numActive == capacity) return false;
+        int index = 0;
+        while (slots[index].grain.has_value()) index++;
+        Slot& slot = slots[index];
+        slot.grain.emplace(std::forward<Args>(args)...);
+        if (slot.grain->isCulled()){
+            slot.grain.reset();
+            return false;
+        }
+        slot.rendered = 0;
+        slot.nextFrame = 0;
+        for (auto& ring : slot.ring) std::fill(std::begin(ring), std::end(ring), 0.0f);
+        active[numActive++] = index;
+        return true;
+    }
+
+    int size() const {return numActive;}
+
+    // adds every grain that sounds in [blockStart, blockStart + block.getNumSamples()) into block
+    template <typename SampleType>
+    void render(const SpectralFrames& frames, juce::AudioBuffer<SampleType>& block, long long int blockStart)
+    {
+        for (int i = 0; i < numActive; i++){
+            Slot& slot = slots[active[i]];
+            const Grain& g = *slot.grain;
+            int offset, d0, count;
+            if (! g.window(blockStart, block.getNumSamples(), offset, d0, count)) continue;
+            const int numSources = juce::jmin(maxSources, g.numSources(*frames.getSource(), block.getNumChannels()));
+
+            //samples before the window (the culled start) are worked out and thrown away
+            while (slot.rendered < d0 + count){
+                while (frameStart(slot.nextFrame) <= slot.rendered) addFrame(slot, frames, numSources);
+                const int a = slot.rendered;
+                const int n = juce::jmin(a < d0 ? d0 : d0 + count, frameStart(slot.nextFrame)) - a;
+                const bool keep = a >= d0;
+                if (keep) g.fillGain(getTemp<SampleType>(1), a, n);
+                for (int s = 0; s < numSources; s++){
+                    SampleType* out = getTemp<SampleType>(0);
+                    float* ring = slot.ring[s];
+                    for (int k = 0; k < n; k++){
+                        float& r = ring[(a + k) & (SpectralFrames::size - 1)];
+                        out[k] = (SampleType) r;
+                        r = 0;
+                    }
+                    if (! keep) continue;
+                    juce::FloatVectorOperations::multiply(out, getTemp<SampleType>(1), n);
+                    g.addSource(block, offset + a - d0, s, frames.getSource()->getNumChannels(), out, n);
+                }
+                slot.rendered += n;
+            }
+        }
+    }
+
+    // frees every grain that has nothing left to play at or after `time`
+    void retireFinished(long long int time)
+    {
+        for (int i = numActive - 1; i >= 0; i--){
+            Slot& slot = slots[active[i]];
+            if (slot.grain->end() > time) continue;
+            slot.grain.reset();
+            active[i] = active[--numActive];
+        }
+    }
+
+    void clear() {retireFinished(std::numeric_limits<long long int>::max());}
+
+    // trades every grain, with its phases and ring, with another set
+    void swap(SpectralGrains& other)
+    {
+        std::swap(slots, other.slots);
+        std::swap(active, other.active);
+        std::swap(numActive, other.numActive);
+    }
+
+private:
+    struct Slot
+    {
+        std::optional<Grain> grain;
+        int rendered = 0;   //next sample (from onset) to take from the ring
+        int nextFrame = 0;
+        float ring[maxSources][SpectralFrames::size];
+        float phase[maxSources][SpectralFrames::numBins];
+    };
+
+    // first output sample (from onset) that frame k covers, frames 0 to 3 all cover sample 0
+    static int frameStart(int k) {return (k - 3) * SpectralFrames::hop;}
+
+    // resynthesises the grain's next frame into its ring, only from the first sample not yet taken
+    void addFrame(Slot& slot, const SpectralFrames& frames, int numSources){
+        const Grain& g = *slot.grain;
+        const int k = slot.nextFrame++;
+        const int numFrames = frames.getNumFrames();
+        int frame = (int) (((juce::int64) (g.startPos + SpectralFrames::hop / 2) / SpectralFrames::hop + (g.rev ? -k : k)) % numFrames);
+        if (frame < 0) frame += numFrames;
+        const float ratio = g.rate;
+        const float twoPi = juce::MathConstants<float>::twoPi;
+
+        for (int s = 0; s < numSources; s++){
+            const int channel = s % frames.getNumChannels();
+            const SpectralFrames::Bin* bins = frames.getBins(channel, frame);
+            for (int b = 0; b < SpectralFrames::numBins; b++){
+                mag[b] = SpectralFrames::magnitudeOf(bins[b]);
+                freq[b] = SpectralFrames::frequencyOf(bins[b], b);
+            }
+            float* phase = slot.phase[s];
+            for (int b = 0; b < SpectralFrames::numBins; b++){
+                //output bin b takes the source at b / ratio, its frequency scaled by ratio
+                const float sourceBin = (float) b / ratio;
+                const int i0 = (int) sourceBin;
+                float m = 0, w = 0;
+                if (i0 < SpectralFrames::numBins - 1){
+                    const float f = sourceBin - (float) i0;
+                    m = mag[i0] + f * (mag[i0 + 1] - mag[i0]);
+                    w = (freq[i0] + f * (freq[i0 + 1] - freq[i0])) * ratio;
+                }
+                //the first frame starts every bin where a steady partial would be at that point of the file
+                float p = k == 0 ? w * (float) (frame * SpectralFrames::hop) : phase[b] + w * (float) SpectralFrames::hop;
+                p -= twoPi * std::floor(p / twoPi);
+                phase[b] = p;
+                data[2 * b] = m * std::cos(p);
+                data[2 * b + 1] = m * std::sin(p);
+            }
+            fft.performRealOnlyInverseTransform(data);
+
+            //the frame comes back zero-phase; Hann analysis and synthesis windows at a quarter-frame hop add up to 1.5
+            const int start = frameStart(k);
+            float* ring = slot.ring[s];
+            for (int i = juce::jmax(0, slot.rendered - start); i < SpectralFrames::size; i++)
+                ring[(start + i) & (SpectralFrames::size - 1)] += data[(i + SpectralFrames::size / 2) & (SpectralFrames::size - 1)] * window[i] * (1.0f / 1.5f);
+        }
+    }
+
+    template <typename SampleType>
+    SampleType* getTemp(int index){
+        if constexpr (std::is_same_v<SampleType, double>) return tempDouble[index];
+        else return tempFloat[index];
+    }
+
+    static constexpr int chunkSize = SpectralFrames::hop;   //longest run between two frames
+
+    std::unique_ptr<Slot[]> slots;
+    int active[capacity];
+    int numActive = 0;
+
+    juce::dsp::FFT fft {SpectralFrames::order};
+    float data[SpectralFrames::size * 2];
+    float mag[SpectralFrames::numBins], freq[SpectralFrames::numBins];   //the frame being resynthesised, unpacked
+    const std::array<float, SpectralFrames::size> window = makeWindow();
+    float tempFloat[2][chunkSize];
+    double tempDouble[2][chunkSize];
+
+    static std::array<float, SpectralFrames::size> makeWindow(){
+        std::array<float, SpectralFrames::size> w;
+        for (int i = 0; i < SpectralFrames::size; i++)
+            w[(size_t) i] = 0.5f - 0.5f * std::cos(juce::MathConstants<float>::twoPi * (float) i / (float) SpectralFrames::size);
+        return w;
+    }
+
+    JUCE_DECLARE_NON_COPYABLE (SpectralGrains)
+};